@@ -9,585 +9,6669 @@
 #include <vector>
 #include <cstdlib>
 #include <string>
+#include <string_view>
 #include <iomanip>
 #include <cstring>
+#include <cmath>
+#include <charconv>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <map>
+#include <set>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "mucal.c"
 
 using namespace std;
 
+//Heap allocations made while counting is switched on. Only the allocation checks of
+//--bench and --validate switch it on (see CountAllocations); otherwise an allocation
+//costs one relaxed load on top of malloc.
+atomic < bool > counting_allocations(false);
+atomic < size_t > allocation_count(0);
+
+//Every replaceable form of operator new allocates here, and every operator delete
+//frees with free(), so the whole family stays matched
+void * allocate(size_t size, size_t alignment, bool nothrow)
+{
+    if (counting_allocations.load(memory_order_relaxed)) allocation_count.fetch_add(1, memory_order_relaxed);
+
+    void * block = NULL;
+
+    if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) block = malloc(size ? size : 1);
+    else if (posix_memalign(&block, alignment, size ? size : 1) != 0) block = NULL;
+
+    if (block == NULL && !nothrow) throw bad_alloc();
+    return block;
+}
+
+void * operator new(size_t size) { return allocate(size, 0, false); }
+void * operator new[](size_t size) { return allocate(size, 0, false); }
+void * operator new(size_t size, const nothrow_t &) noexcept { return allocate(size, 0, true); }
+void * operator new[](size_t size, const nothrow_t &) noexcept { return allocate(size, 0, true); }
+void * operator new(size_t size, align_val_t alignment) { return allocate(size, (size_t) alignment, false); }
+void * operator new[](size_t size, align_val_t alignment) { return allocate(size, (size_t) alignment, false); }
+void * operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept { return allocate(size, (size_t) alignment, true); }
+void * operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept { return allocate(size, (size_t) alignment, true); }
+
+void operator delete(void * block) noexcept { free(block); }
+void operator delete[](void * block) noexcept { free(block); }
+void operator delete(void * block, size_t) noexcept { free(block); }
+void operator delete[](void * block, size_t) noexcept { free(block); }
+void operator delete(void * block, const nothrow_t &) noexcept { free(block); }
+void operator delete[](void * block, const nothrow_t &) noexcept { free(block); }
+void operator delete(void * block, align_val_t) noexcept { free(block); }
+void operator delete[](void * block, align_val_t) noexcept { free(block); }
+void operator delete(void * block, size_t, align_val_t) noexcept { free(block); }
+void operator delete[](void * block, size_t, align_val_t) noexcept { free(block); }
+void operator delete(void * block, align_val_t, const nothrow_t &) noexcept { free(block); }
+void operator delete[](void * block, align_val_t, const nothrow_t &) noexcept { free(block); }
+
+//Counts heap allocations for as long as it is in scope
+class CountAllocations
+{
+    public:
+
+    CountAllocations() { counting_allocations.store(true); }
+    ~CountAllocations() { counting_allocations.store(false); }
+};
+
 //Error codes
 const int NO_ERR = 0;
 const int EXIT_CMD = -1;
 const int BAD_INPUT = -2;
 const int NO_SAMPLES = -3;
+const int NO_DATA = -4;
 
-class Sample
+//64-bit FNV-1a hash, used for checksums and cache keys
+uint64_t fnv1a(const char * data, size_t size, uint64_t hash = 14695981039346656037ULL)
 {
-    private:
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
 
-    //User Defined
-    string name; //Name of sample
-    vector < string > elements; //List of elements in sample (element symbols)
-    vector < float > mass_percents; //Percent of each element by weight
-    float density; //Bulk density of material (g/cm^3)
+    return hash;
+}
 
-    //Calculated
-    float energy;
-    float mu;
-    float absorption_length;
-    float volume;
-    float radius;
-    float mass;
-    vector < float > masses;
+//Bumped whenever the backend in use or the data behind it changes, so cached cross
+//sections can tell they are out of date
+atomic < unsigned > cross_section_revision(1);
 
+//Source of per-element x-ray data. Implementations fill the same output arrays as
+//mucal(), with cross sections in cm^2/g, so callers can switch between them freely.
+class CrossSectionBackend
+{
     public:
 
-    Sample(string name);
-    int compute(); //Compute xray properties at a given energy
-    int dilute(string compound); //Dilute sample using a specified compound
-    int rename(string sample_name); //Change sample name
-    int write_screen(); //Write sample data to screen
-    int write_file(string file_name); //Write sample data to file
-    int compute_dilution(float percent); //Computes BN dilution of a sample and resulting effect on absorption length
+    virtual ~CrossSectionBackend() {}
+    virtual string get_name() = 0;
 
-    string get_name();
-    int get_num_elements();
-    double get_energy();
+    //Identifies the data and settings results depend on; changes whenever they do
+    virtual string get_version() { return get_name(); }
+    virtual int evaluate(const string & symbol, double ephot, int pflag,
+                         double * energy, double * xsec, double * fluo, char * errmsg) = 0;
 
-    int set_name(string new_name);
-    int set_energy(float inp_energy);
-    int set_density(float inp_density);
-    int set_elements (vector < string > inp_elements);
-    int set_num_elements(int num);
-    int set_mass_percents (vector < float > inp_mass_percents);
+    //Total mass attenuation (cm^2/g) at many energies. Returns the first error met.
+    virtual int evaluate_mu(const string & symbol, const double * energies, double * mu, size_t num);
 };
 
-Sample::Sample(string sample_name)
+int CrossSectionBackend::evaluate_mu(const string & symbol, const double * energies, double * mu, size_t num)
 {
-    name = sample_name;
+    double energy[9];
+    double xsec[11];
+    double fluo[4];
+    char err_msg[100];
+    int err = no_error;
+
+    for (size_t n = 0; n < num; n++)
+    {
+        int status = evaluate(symbol, energies[n], 0, energy, xsec, fluo, err_msg);
+        if (status != no_error && err == no_error) err = status;
+
+        mu[n] = xsec[3];
+    }
+
+    return err;
 }
 
-string Sample::get_name()
+//mucal evaluation specialized at compile time for an element known to have data.
+//UNIT is unit_cm2g or unit_barns and WANT a combination of the want_ flags; with both
+//fixed the evaluation is inlined and only the requested quantities are computed.
+template < int UNIT, int WANT >
+inline int mucal_eval(int Z, double ephot, double * energy, double * xsec, double * fluo)
 {
-    return name;
+    return mucal_core(mucal_element(Z), ephot, UNIT, WANT, energy, xsec, fluo);
 }
 
-double Sample::get_energy()
+//Read-only view over one of mucal's element constant tables, indexed by Z
+class ConstantView
 {
-    return energy;
+    private:
+
+    const double * data;
+    int size;
+
+    public:
+
+    ConstantView(const double * inp_data, int inp_size) : data(inp_data), size(inp_size) {}
+    double operator[](int Z) const { return data[Z - 1]; }
+    int get_size() const { return size; }
+    const double * begin() const { return data; }
+    const double * end() const { return data + size; }
+};
+
+//Edge energies (keV); edge 0 is K, 1-3 are L1-L3 and 4 is M
+ConstantView edge_energies(int edge)
+{
+    const mu_columns * columns = mucal_columns();
+    const double * tables[] = {columns->k_edge, columns->l1_edge, columns->l2_edge, columns->l3_edge, columns->m_edge};
+
+    return ConstantView(tables[edge], columns->zmax);
 }
 
-int Sample::get_num_elements()
+//Atomic weights (g/mole)
+ConstantView atomic_weights()
 {
-    return elements.size();
+    return ConstantView(mucal_columns()->at_weight, mucal_columns()->zmax);
 }
 
-int Sample::set_energy(float inp_energy)
+//Densities of the pure elements (g/cm^3)
+ConstantView element_densities()
 {
-    energy = inp_energy;
-    return NO_ERR;
+    return ConstantView(mucal_columns()->density, mucal_columns()->zmax);
 }
 
-int Sample::set_density(float inp_density)
+//McMaster 1969 fits, as implemented by mucal
+class McMasterBackend : public CrossSectionBackend
 {
-    density = inp_density;
-    return NO_ERR;
+    public:
+
+    string get_name();
+    string get_version();
+    int evaluate(const string & symbol, double ephot, int pflag,
+                 double * energy, double * xsec, double * fluo, char * errmsg);
+    int evaluate_mu(const string & symbol, const double * energies, double * mu, size_t num);
+};
+
+string McMasterBackend::get_name()
+{
+    return "mcmaster";
 }
 
-int Sample::set_elements (vector < string > inp_elements)
+string McMasterBackend::get_version()
 {
-    elements = inp_elements;
-    return NO_ERR;
+    return mucal_fast_math(-1) ? "mcmaster/fast" : "mcmaster";
 }
 
-int Sample::set_num_elements(int num)
+int McMasterBackend::evaluate(const string & symbol, double ephot, int pflag,
+                              double * energy, double * xsec, double * fluo, char * errmsg)
 {
-    elements.resize(num);
-    mass_percents.resize(num);
-    masses.resize(num);
-    return NO_ERR;
+    char elemName[3];
+
+    strncpy(elemName, symbol.c_str(), 2);
+    elemName[2] = 0;
+
+    return mucal(elemName, 0, ephot, 'c', pflag, energy, xsec, fluo, errmsg);
 }
 
-int Sample::set_name(string new_name)
+int McMasterBackend::evaluate_mu(const string & symbol, const double * energies, double * mu, size_t num)
 {
-    name = new_name;
+    char elemName[3];
+
+    strncpy(elemName, symbol.c_str(), 2);
+    elemName[2] = 0;
+
+    //Validate the element once, then evaluate only the total for each energy
+    int Z = name_z(elemName);
+
+    if (!mucal_has_data(Z)) return CrossSectionBackend::evaluate_mu(symbol, energies, mu, num);
+
+    int err = no_error;
+
+    for (size_t n = 0; n < num; n++)
+    {
+        if (energies[n] > 0)
+        {
+            mu[n] = mu_z(Z, energies[n]);
+        }
+        else
+        {
+            CrossSectionBackend::evaluate_mu(symbol, energies + n, mu + n, 1);
+            err = bad_energy;
+        }
+    }
+
+    return err;
+}
+
+//Layout of a tabulated cross-section file. The file is a header, one entry per Z
+//and a data block of doubles. Each entry points at 'count' ascending ln(E/keV)
+//values followed by 'count' ln(mu/rho) values in cm^2/g; an edge is a repeated
+//energy with the below- and above-edge values in that order.
+struct TableHeader
+{
+    char magic[8]; //"XSTABLE"
+    int32_t version;
+    int32_t num_z;
+};
+
+struct TableEntry
+{
+    double energy[9]; //Edges and emission lines, as returned by mucal
+    double fluo[4]; //Fluorescence yields
+    double at_weight;
+    double density;
+    int64_t offset; //Offset of the energies in the data block (doubles)
+    int64_t count; //Number of tabulated points, 0 if there is no data
+};
+
+const int32_t TABLE_VERSION = 1;
+
+//Tabulated cross sections memory mapped from a file and interpolated in log-log space.
+//The mapping is read-only and shared, so every process using the same file shares one
+//copy in the page cache.
+class TableBackend : public CrossSectionBackend
+{
+    private:
+
+    string file_name;
+    void * map;
+    size_t map_size;
+    const TableHeader * header;
+    const TableEntry * entries;
+    const double * data;
+    uint64_t checksum; //Of the file's identity and modification time, so a rewritten table is a new version
+
+    public:
+
+    TableBackend();
+    ~TableBackend();
+    int open(string inp_file_name);
+    int close();
+
+    string get_name();
+    string get_version();
+    int evaluate(const string & symbol, double ephot, int pflag,
+                 double * energy, double * xsec, double * fluo, char * errmsg);
+};
+
+TableBackend::TableBackend()
+{
+    map = NULL;
+    map_size = 0;
+    checksum = 0;
+}
+
+TableBackend::~TableBackend()
+{
+    close();
+}
+
+int TableBackend::open(string inp_file_name)
+{
+    close();
+
+    int fd = ::open(inp_file_name.c_str(), O_RDONLY);
+
+    if (fd < 0) return BAD_INPUT;
+
+    struct stat info;
+
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(TableHeader))
+    {
+        ::close(fd);
+        return BAD_INPUT;
+    }
+
+    map_size = info.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        return BAD_INPUT;
+    }
+
+    header = (const TableHeader *) map;
+    entries = (const TableEntry *) (header + 1);
+    data = (const double *) (entries + header->num_z);
+
+    //Check the header and that every entry points inside the file
+    bool valid = strncmp(header->magic, "XSTABLE", 8) == 0 && header->version == TABLE_VERSION && header->num_z > 0 &&
+                 sizeof(TableHeader) + header->num_z * sizeof(TableEntry) <= map_size;
+
+    size_t num_data = valid ? (map_size - ((const char *) data - (const char *) map)) / sizeof(double) : 0;
+
+    for (int z = 0; valid && z < header->num_z; z++)
+    {
+        valid = entries[z].count >= 0 && entries[z].offset >= 0 &&
+                (size_t) (entries[z].offset + 2 * entries[z].count) <= num_data;
+    }
+
+    if (!valid)
+    {
+        close();
+        return BAD_INPUT;
+    }
+
+    file_name = inp_file_name;
+
+    //Hashing the file itself would read every page of a large table on each open, so
+    //key the version on which file it is and when it last changed instead
+    uint64_t identity[5] = {(uint64_t) info.st_dev, (uint64_t) info.st_ino, (uint64_t) info.st_size,
+                            (uint64_t) info.st_mtim.tv_sec, (uint64_t) info.st_mtim.tv_nsec};
+    checksum = fnv1a((const char *) identity, sizeof(identity));
+
     return NO_ERR;
 }
 
-int Sample::set_mass_percents (vector < float > inp_mass_percents)
+int TableBackend::close()
 {
-    mass_percents = inp_mass_percents;
+    if (map != NULL)
+    {
+        munmap(map, map_size);
+        cross_section_revision++;
+    }
+
+    map = NULL;
+    map_size = 0;
+
     return NO_ERR;
 }
 
-int Sample::write_screen()
+string TableBackend::get_name()
 {
-    cout << endl << "------------------------------------" << endl << endl;
-    cout << "Sample Name: " << name << endl << endl;
-    cout << "Sample Composition:" << endl << endl;
+    return "table:" + file_name;
+}
 
-    for (int i = 0; i < elements.size(); i++)
+string TableBackend::get_version()
+{
+    char text[32];
+
+    snprintf(text, sizeof(text), "/%016llx", (unsigned long long) checksum);
+    return get_name() + text;
+}
+
+int TableBackend::evaluate(const string & symbol, double ephot, int pflag,
+                           double * energy, double * xsec, double * fluo, char * errmsg)
+{
+    char elemName[3];
+
+    strncpy(elemName, symbol.c_str(), 2);
+    elemName[2] = 0;
+
+    int Z = name_z(elemName);
+
+    *errmsg = 0;
+
+    if (map == NULL || Z < 1 || Z > header->num_z)
     {
-        cout << setprecision(5) << mass_percents[i] << "  " << elements[i] << endl;
+        sprintf(errmsg, "table: no data for element %s", symbol.c_str());
+        if (pflag) fprintf(stderr, "\n%s\a\n\n", errmsg);
+        return no_data;
     }
 
-    cout << endl;
+    const TableEntry & entry = entries[Z - 1];
 
-    cout << "Photon Energy (keV): " << energy << endl;
-    cout << "Absorption Coefficient (1/cm): " << mu << endl;
-    cout << "Absorption Length (microns): " << absorption_length << endl << endl;
-    cout << "Pellet Density (g/cm^3): " << density << endl;
-    cout << "Pellet Radius (cm): " << radius << endl;
-    cout << "Pellet Volume (cm^3): " << volume << endl;
-    cout << "Pellet Mass (g): " << mass << endl;
-    cout << endl << "Pellet Masses by Element (g): " << endl << endl;
+    for (int i = 0; i < 9; i++) energy[i] = entry.energy[i];
+    for (int i = 0; i < 4; i++) fluo[i] = entry.fluo[i];
+    for (int i = 0; i < 11; i++) xsec[i] = 0;
+
+    xsec[6] = entry.at_weight;
+    xsec[7] = entry.density;
+
+    if (ephot == 0) return no_error;
+
+    const double * log_e = data + entry.offset;
+    const double * log_mu = log_e + entry.count;
+    double x = log(ephot);
+
+    if (entry.count < 2 || ephot < 0 || x < log_e[0] || x > log_e[entry.count - 1])
+    {
+        sprintf(errmsg, "table: %g keV is outside the tabulated range for %s", ephot, symbol.c_str());
+        if (pflag) fprintf(stderr, "\n%s\a\n\n", errmsg);
+        return (entry.count < 2) ? no_data : bad_energy;
+    }
+
+    //Interval above any repeated (edge) energy equal to x
+    int64_t upper = upper_bound(log_e, log_e + entry.count, x) - log_e;
+    if (upper == entry.count) upper--;
+    int64_t lower = upper - 1;
+
+    double t = (x - log_e[lower]) / (log_e[upper] - log_e[lower]);
+
+    xsec[3] = exp(log_mu[lower] + t * (log_mu[upper] - log_mu[lower]));
+    xsec[5] = xsec[3] * entry.density;
+
+    return no_error;
+}
+
+//Writes tabulated cross sections for Z = 1..points.size() in the TableBackend format.
+//Constants are taken from mucal where it has them.
+int write_table(string file_name, vector < vector < pair < double, double > > > & points)
+{
+    ofstream file(file_name.c_str(), ios::binary);
+
+    if (!file) return BAD_INPUT;
+
+    TableHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, "XSTABLE", 8);
+    header.version = TABLE_VERSION;
+    header.num_z = points.size();
+
+    file.write((const char *) &header, sizeof(header));
+
+    int64_t offset = 0;
+
+    for (int z = 0; z < points.size(); z++)
+    {
+        TableEntry entry;
+        double xsec[11];
+        char err_msg[100];
+
+        memset(&entry, 0, sizeof(entry));
+
+        if (mucal((char *) "", z + 1, 0, 'c', 0, entry.energy, xsec, entry.fluo, err_msg) == no_error)
+        {
+            entry.at_weight = xsec[6];
+            entry.density = xsec[7];
+        }
+        else
+        {
+            memset(&entry, 0, sizeof(entry));
+        }
+
+        entry.offset = offset;
+        entry.count = points[z].size();
+        offset += 2 * entry.count;
+
+        file.write((const char *) &entry, sizeof(entry));
+    }
+
+    for (int z = 0; z < points.size(); z++)
+    {
+        for (int i = 0; i < points[z].size(); i++)
+        {
+            double value = log(points[z][i].first);
+            file.write((const char *) &value, sizeof(double));
+        }
+
+        for (int i = 0; i < points[z].size(); i++)
+        {
+            double value = log(points[z][i].second);
+            file.write((const char *) &value, sizeof(double));
+        }
+    }
+
+    file.close();
+
+    return file ? NO_ERR : BAD_INPUT;
+}
+
+//Tabulates the McMaster fits between 1 and 1000 keV with a repeated point at each edge
+int export_table(string file_name, int points_per_decade)
+{
+    vector < vector < pair < double, double > > > points(94);
+
+    for (int z = 0; z < 94; z++)
+    {
+        double energy[9];
+        double xsec[11];
+        double fluo[4];
+        char err_msg[100];
+
+        if (mucal((char *) "", z + 1, 0, 'c', 0, energy, xsec, fluo, err_msg) != no_error) continue;
+
+        //Pairs of evaluation and tabulated energy; below-edge points are evaluated
+        //just under the edge and stored at the edge itself
+        vector < pair < double, double > > grid;
+
+        for (int i = 0; i <= 3 * points_per_decade; i++)
+        {
+            double at = pow(10.0, (double) i / points_per_decade);
+            grid.push_back(make_pair(at, at));
+        }
+
+        for (int j = 0; j < 5; j++)
+        {
+            if (energy[j] > 1 && energy[j] < 1000)
+            {
+                grid.push_back(make_pair(energy[j] * (1 - 1e-9), energy[j]));
+                grid.push_back(make_pair(energy[j], energy[j]));
+            }
+        }
+
+        sort(grid.begin(), grid.end());
+
+        for (int i = 0; i < grid.size(); i++)
+        {
+            mucal((char *) "", z + 1, grid[i].first, 'c', 0, energy, xsec, fluo, err_msg);
+            points[z].push_back(make_pair(grid[i].second, xsec[3]));
+        }
+    }
+
+    return write_table(file_name, points);
+}
+
+//Reads a text table of 'Z energy(keV) mu(cm^2/g)' rows, ordered by energy within each Z
+int import_table(string text_file_name, string file_name)
+{
+    ifstream file(text_file_name.c_str());
+
+    if (!file) return BAD_INPUT;
+
+    vector < vector < pair < double, double > > > points;
+    string line;
+
+    while (getline(file, line))
+    {
+        stringstream row(line);
+        int z;
+        double energy, mu;
+
+        if (line.size() == 0 || line[0] == '#') continue;
+        if (!(row >> z >> energy >> mu) || z < 1 || energy <= 0 || mu <= 0) return BAD_INPUT;
+
+        if (points.size() < z) points.resize(z);
+        points[z - 1].push_back(make_pair(energy, mu));
+    }
+
+    return write_table(file_name, points);
+}
+
+//McMaster fits precomputed as ln(mu) against ln(E) on a uniform grid between edges.
+//Each element is tabulated the first time it is used, split at its K, L1, L2, L3 and
+//M edges so no interval crosses a discontinuity, and checked against mucal at the
+//midpoint of every interval, where linear interpolation error is largest. The grid
+//is refined until the check passes, so the reported error is a bound for the grid.
+//Energies outside 1-1000 keV fall back to mucal.
+class InterpolatedBackend : public CrossSectionBackend
+{
+    private:
+
+    static const int MAX_SEGMENTS = 6;
+
+    struct ElementTable
+    {
+        int status; //mucal return code for the element
+        double energy[9];
+        double xsec[11]; //Energy independent constants
+        double fluo[4];
+        int num_segments;
+        double bounds[MAX_SEGMENTS + 1]; //ln(E) of the segment boundaries
+        double inv_step[MAX_SEGMENTS];
+        int offset[MAX_SEGMENTS];
+        int intervals[MAX_SEGMENTS];
+        vector < double > log_mu;
+        double max_error; //Largest relative error found by the check
+    };
+
+    ElementTable tables[94];
+    once_flag built[94];
+    double step; //Initial grid spacing in ln(E)
+    double tolerance; //Relative error bound the grid is refined to
+
+    ElementTable & table(int Z);
+    void build(int Z);
+
+    public:
+
+    InterpolatedBackend();
+    string get_name();
+    string get_version();
+    int evaluate(const string & symbol, double ephot, int pflag,
+                 double * energy, double * xsec, double * fluo, char * errmsg);
+    int evaluate_mu(const string & symbol, const double * energies, double * mu, size_t num);
+
+    double get_max_error(int Z); //Checked relative error bound for an element
+    double get_tolerance();
+};
+
+InterpolatedBackend::InterpolatedBackend()
+{
+    step = 2e-3;
+    tolerance = 1e-5;
+}
+
+string InterpolatedBackend::get_name()
+{
+    return "interpolated";
+}
+
+string InterpolatedBackend::get_version()
+{
+    return "interpolated/" + to_string(tolerance) + (mucal_fast_math(-1) ? "/fast" : "");
+}
+
+double InterpolatedBackend::get_tolerance()
+{
+    return tolerance;
+}
+
+InterpolatedBackend::ElementTable & InterpolatedBackend::table(int Z)
+{
+    call_once(built[Z - 1], &InterpolatedBackend::build, this, Z);
+    return tables[Z - 1];
+}
+
+void InterpolatedBackend::build(int Z)
+{
+    ElementTable & t = tables[Z - 1];
+    char err_msg[100];
+
+    t.status = mucal((char *) "", Z, 0, 'c', 0, t.energy, t.xsec, t.fluo, err_msg);
+    t.num_segments = 0;
+    t.max_error = 0;
+
+    if (t.status != no_error) return;
+
+    //Segment boundaries: the range ends and every edge inside it
+    vector < double > bounds;
+    bounds.push_back(1);
+    bounds.push_back(1000);
+
+    for (int j = 0; j < 5; j++)
+    {
+        if (t.energy[j] > 1 && t.energy[j] < 1000) bounds.push_back(t.energy[j]);
+    }
+
+    sort(bounds.begin(), bounds.end());
+    bounds.erase(unique(bounds.begin(), bounds.end()), bounds.end());
+
+    t.num_segments = bounds.size() - 1;
+
+    for (int s = 0; s <= t.num_segments; s++) t.bounds[s] = log(bounds[s]);
+
+    for (double h = step; ; h /= 2)
+    {
+        t.log_mu.clear();
+        t.max_error = 0;
+
+        for (int s = 0; s < t.num_segments; s++)
+        {
+            double width = t.bounds[s + 1] - t.bounds[s];
+
+            t.intervals[s] = max(1, (int) ceil(width / h));
+            t.inv_step[s] = t.intervals[s] / width;
+            t.offset[s] = t.log_mu.size();
+
+            for (int i = 0; i <= t.intervals[s]; i++)
+            {
+                double e = exp(t.bounds[s] + i / t.inv_step[s]);
+
+                //The last node of a segment takes the value just below the next edge
+                if (i == t.intervals[s]) e = bounds[s + 1] * (1 - 1e-12);
+                if (i == 0) e = bounds[s];
+
+                t.log_mu.push_back(log(mu_z(Z, e)));
+            }
+
+            for (int i = 0; i < t.intervals[s]; i++)
+            {
+                double e = exp(t.bounds[s] + (i + 0.5) / t.inv_step[s]);
+
+                double direct = mu_z(Z, e);
+                double interpolated = exp(0.5 * (t.log_mu[t.offset[s] + i] + t.log_mu[t.offset[s] + i + 1]));
+                t.max_error = max(t.max_error, fabs(interpolated - direct) / direct);
+            }
+        }
+
+        if (t.max_error <= tolerance || h < 1e-5) break;
+    }
+}
+
+double InterpolatedBackend::get_max_error(int Z)
+{
+    return table(Z).max_error;
+}
+
+int InterpolatedBackend::evaluate(const string & symbol, double ephot, int pflag,
+                                  double * energy, double * xsec, double * fluo, char * errmsg)
+{
+    char elemName[3];
+
+    strncpy(elemName, symbol.c_str(), 2);
+    elemName[2] = 0;
+
+    int Z = name_z(elemName);
+
+    if (Z < 1 || Z > 94 || ephot < 1 || ephot > 1000)
+    {
+        return mucal(elemName, 0, ephot, 'c', pflag, energy, xsec, fluo, errmsg);
+    }
+
+    ElementTable & t = table(Z);
+
+    if (t.status != no_error)
+    {
+        return mucal(elemName, 0, ephot, 'c', pflag, energy, xsec, fluo, errmsg);
+    }
+
+    for (int i = 0; i < 9; i++) energy[i] = t.energy[i];
+    for (int i = 0; i < 11; i++) xsec[i] = t.xsec[i];
+    for (int i = 0; i < 4; i++) fluo[i] = t.fluo[i];
+
+    *errmsg = 0;
+
+    //Only the total is tabulated
+    evaluate_mu(symbol, &ephot, &xsec[3], 1);
+    xsec[4] = t.xsec[4];
+    xsec[5] = xsec[3] * t.xsec[7];
+
+    return no_error;
+}
+
+int InterpolatedBackend::evaluate_mu(const string & symbol, const double * energies, double * mu, size_t num)
+{
+    char elemName[3];
+
+    strncpy(elemName, symbol.c_str(), 2);
+    elemName[2] = 0;
+
+    int Z = name_z(elemName);
+
+    if (Z < 1 || Z > 94 || table(Z).status != no_error)
+    {
+        return CrossSectionBackend::evaluate_mu(symbol, energies, mu, num);
+    }
+
+    const ElementTable & t = table(Z);
+    const double * log_mu = t.log_mu.data();
+    int last = t.num_segments - 1;
+    int err = no_error;
+
+    //Branch-free segment and index lookup so the loop vectorizes
+    for (size_t n = 0; n < num; n++)
+    {
+        //Energies that are not positive and finite are looked up at the table start and
+        //replaced below, so the index never comes from a NaN or infinity
+        double x = (energies[n] > 0 && energies[n] < HUGE_VAL) ? log(energies[n]) : t.bounds[0];
+        int s = 0;
+
+        for (int b = 1; b <= last; b++) s += (x >= t.bounds[b]);
+
+        double position = (x - t.bounds[s]) * t.inv_step[s];
+        position = min(max(position, 0.0), (double) t.intervals[s]);
+
+        int i = min((int) position, t.intervals[s] - 1);
+        double frac = position - i;
+        const double * node = log_mu + t.offset[s] + i;
+
+        mu[n] = exp(node[0] + frac * (node[1] - node[0]));
+    }
+
+    //Points outside the tabulated range are recomputed directly
+    for (size_t n = 0; n < num; n++)
+    {
+        if (!(energies[n] > 0 && energies[n] < HUGE_VAL))
+        {
+            mu[n] = 0;
+            err = bad_energy;
+        }
+        else if (energies[n] < 1 || energies[n] > 1000)
+        {
+            double energy[9];
+            double xsec[11];
+            double fluo[4];
+            char err_msg[100];
+
+            int status = mucal(elemName, 0, energies[n], 'c', 0, energy, xsec, fluo, err_msg);
+            if (status != no_error && err == no_error) err = status;
+
+            mu[n] = xsec[3];
+        }
+    }
+
+    return err;
+}
+
+//Backend used for all cross-section evaluation
+McMasterBackend mcmaster_backend;
+TableBackend table_backend;
+InterpolatedBackend interpolated_backend;
+CrossSectionBackend * backend = &mcmaster_backend;
+
+const double PI = 3.14159265358979323846;
+
+//Compensated (Neumaier) sum. Every reduction over elements adds its terms in element
+//order with one of these, so a result never depends on how many threads or which
+//scheduler computed it, and rounding stays well below the last printed digit.
+struct CompensatedSum
+{
+    double sum;
+    double compensation;
+
+    CompensatedSum() : sum(0), compensation(0) {}
+
+    void add(double term)
+    {
+        double total = sum + term;
+
+        if (fabs(sum) >= fabs(term)) compensation += (sum - total) + term;
+        else compensation += (term - total) + sum;
+
+        sum = total;
+    }
+
+    double get() const { return sum + compensation; }
+};
+
+//Records timed spans on every thread and writes them as Chrome trace-event JSON, which
+//chrome://tracing and Perfetto open directly. Each thread keeps its own event buffer,
+//so recording takes no lock; when tracing is off a span costs one relaxed load.
+class Tracer
+{
+    private:
+
+    struct Event
+    {
+        const char * name; //Always a string literal
+        int lane;
+        double start; //Microseconds since start()
+        double duration;
+    };
+
+    mutex lock;
+    vector < vector < Event > * > buffers; //One per thread that has recorded, owned here
+    chrono::steady_clock::time_point origin;
+    string file_name; //Where stop() writes, empty when not tracing
+
+    vector < Event > & buffer();
+
+    public:
+
+    atomic < bool > enabled;
+
+    static const int WRITER_LANE = 1000; //Lane of output writer threads
+
+    Tracer();
+    ~Tracer();
+    int start(string inp_file_name);
+    void record(const char * name, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end);
+    int stop(); //Write everything recorded since start(), if tracing
+
+    static void set_lane(int lane); //Timeline row for spans of the calling thread
+};
+
+thread_local int trace_lane = 0; //0 is the main thread, n the n-th scheduler worker
+
+Tracer::Tracer() : enabled(false)
+{
+}
+
+Tracer::~Tracer()
+{
+    for (int i = 0; i < buffers.size(); i++) delete buffers[i];
+}
+
+int Tracer::start(string inp_file_name)
+{
+    if (inp_file_name.size() == 0) return BAD_INPUT;
+
+    lock_guard < mutex > guard(lock);
+
+    for (int i = 0; i < buffers.size(); i++) buffers[i]->clear();
+
+    file_name = inp_file_name;
+    origin = chrono::steady_clock::now();
+    enabled = true;
+
+    return NO_ERR;
+}
+
+void Tracer::set_lane(int lane)
+{
+    trace_lane = lane;
+}
+
+vector < Tracer::Event > & Tracer::buffer()
+{
+    thread_local vector < Event > * events = NULL;
+
+    if (events == NULL)
+    {
+        lock_guard < mutex > guard(lock);
+
+        events = new vector < Event >;
+        buffers.push_back(events);
+    }
+
+    return *events;
+}
+
+void Tracer::record(const char * name, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end)
+{
+    Event event;
+    event.name = name;
+    event.lane = trace_lane;
+    event.start = chrono::duration < double, micro > (begin - origin).count();
+    event.duration = chrono::duration < double, micro > (end - begin).count();
+
+    buffer().push_back(event);
+}
+
+int Tracer::stop()
+{
+    enabled = false;
+
+    lock_guard < mutex > guard(lock);
+
+    if (file_name.size() == 0) return NO_ERR;
+
+    ofstream file(file_name.c_str());
+    file_name = "";
+
+    if (!file) return BAD_INPUT;
+
+    set < int > lanes;
+    char line[256];
+
+    file << "{\"traceEvents\":[" << endl;
+
+    for (int i = 0; i < buffers.size(); i++)
+    {
+        for (size_t k = 0; k < buffers[i]->size(); k++)
+        {
+            const Event & event = (*buffers[i])[k];
+
+            snprintf(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"xafsprep\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d},",
+                     event.name, event.start, event.duration, event.lane);
+            file << line << endl;
+            lanes.insert(event.lane);
+        }
+
+        buffers[i]->clear();
+    }
+
+    //Name the timeline rows
+    for (set < int > ::iterator lane = lanes.begin(); lane != lanes.end(); lane++)
+    {
+        string name = (*lane == 0) ? "main" : (*lane == WRITER_LANE) ? "writer" : "worker " + to_string(*lane);
+
+        file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << *lane << ",\"args\":{\"name\":\"" << name << "\"}},"
+             << endl;
+    }
+
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"xafsprep\"}}" << endl;
+    file << "],\"displayTimeUnit\":\"ms\"}" << endl;
+
+    return file ? NO_ERR : BAD_INPUT;
+}
+
+Tracer tracer;
+
+//Records the time from construction to destruction as a span, if tracing is on
+class TraceSpan
+{
+    private:
+
+    const char * name;
+    bool active;
+    chrono::steady_clock::time_point begin;
+
+    public:
+
+    TraceSpan(const char * inp_name) : name(inp_name), active(tracer.enabled.load(memory_order_relaxed))
+    {
+        if (active) begin = chrono::steady_clock::now();
+    }
+
+    ~TraceSpan()
+    {
+        if (active) tracer.record(name, begin, chrono::steady_clock::now());
+    }
+};
+
+//Sample holder shapes
+const int DISC = 0; //Pressed pellet in a round die
+const int RECTANGLE = 1; //Rectangular cell or slot
+const int FILM = 2; //Film or membrane of known area
+
+//Thickness targets
+const int TARGET_LENGTHS = 0; //Thickness in absorption lengths at the photon energy
+const int TARGET_STEP = 1; //Edge step (change in mu*x across the nearest edge)
+
+class Geometry
+{
+    private:
+
+    string name;
+    int shape;
+    float width; //Radius for discs, width for rectangles, area for films (cm or cm^2)
+    float height; //Height for rectangles (cm)
+    int target_mode;
+    float target;
+
+    public:
+
+    Geometry(string geometry_name);
+    int set_disc(float inp_radius);
+    int set_rectangle(float inp_width, float inp_height);
+    int set_film(float inp_area);
+    int set_target(int mode, float value);
+
+    string get_name();
+    string get_description();
+    float get_area(); //Face area seen by the beam (cm^2)
+    int get_thickness(float mu, float step_mu, float * thickness); //Thickness meeting the target (cm)
+};
+
+Geometry::Geometry(string geometry_name)
+{
+    name = geometry_name;
+    set_disc(0.65);
+    set_target(TARGET_LENGTHS, 1);
+}
+
+int Geometry::set_disc(float inp_radius)
+{
+    shape = DISC;
+    width = inp_radius;
+    height = 0;
+    return NO_ERR;
+}
+
+int Geometry::set_rectangle(float inp_width, float inp_height)
+{
+    shape = RECTANGLE;
+    width = inp_width;
+    height = inp_height;
+    return NO_ERR;
+}
+
+int Geometry::set_film(float inp_area)
+{
+    shape = FILM;
+    width = inp_area;
+    height = 0;
+    return NO_ERR;
+}
+
+int Geometry::set_target(int mode, float value)
+{
+    if (value <= 0) return BAD_INPUT;
+
+    target_mode = mode;
+    target = value;
+    return NO_ERR;
+}
+
+string Geometry::get_name()
+{
+    return name;
+}
+
+string Geometry::get_description()
+{
+    stringstream description;
+
+    if (shape == DISC) description << "disc, radius " << width << " cm";
+    else if (shape == RECTANGLE) description << "rectangle, " << width << " x " << height << " cm";
+    else description << "film, area " << width << " cm^2";
+
+    if (target_mode == TARGET_LENGTHS) description << ", " << target << " absorption length(s)";
+    else description << ", edge step " << target;
+
+    return description.str();
+}
+
+float Geometry::get_area()
+{
+    if (shape == DISC) return PI * width * width;
+    if (shape == RECTANGLE) return width * height;
+    return width;
+}
+
+//Returns NO_DATA, with a thickness of 0, when there is no absorption (or no edge in
+//range for an edge step target) to size the sample by
+int Geometry::get_thickness(float mu, float step_mu, float * thickness)
+{
+    float per_cm = (target_mode == TARGET_STEP) ? step_mu : mu;
+
+    *thickness = 0;
+    if (per_cm <= 0) return NO_DATA;
+
+    *thickness = target / per_cm;
+    return NO_ERR;
+}
+
+//Block of equally sized columns, written out row by row
+struct ColumnBlock
+{
+    vector < string > names;
+    vector < vector < double > > columns;
+    vector < vector < float > > float_columns; //Value columns after 'columns' held in float, widened when written
+    vector < string > labels; //Optional text label in front of each row
+    string comment; //Optional note written ahead of the rows
+    size_t rows;
+    size_t job; //Batch job the rows belong to
+
+    ColumnBlock() : rows(0), job(0) {}
+
+    size_t get_num_columns() const; //Double and float columns together
+    double get(size_t col, size_t row) const;
+};
+
+size_t ColumnBlock::get_num_columns() const
+{
+    return columns.size() + float_columns.size();
+}
+
+double ColumnBlock::get(size_t col, size_t row) const
+{
+    return (col < columns.size()) ? columns[col][row] : float_columns[col - columns.size()][row];
+}
+
+//Appends rows [begin, end) of a column block to a buffer as comma separated text, led
+//by the row labels if 'labels' is set (empty if the block has none)
+void format_columns(const ColumnBlock & block, size_t begin, size_t end, bool labels, string * out)
+{
+    char buffer[32];
+
+    for (size_t row = begin; row < end; row++)
+    {
+        if (labels)
+        {
+            if (block.labels.size()) out->append(block.labels[row]);
+            out->push_back(',');
+        }
+
+        size_t num_columns = block.get_num_columns();
+
+        for (size_t col = 0; col < num_columns; col++)
+        {
+            char * last = to_chars(buffer, buffer + sizeof(buffer), block.get(col, row), chars_format::general, 7).ptr;
+            out->append(buffer, last);
+            out->push_back(col + 1 < num_columns ? ',' : '\n');
+        }
+    }
+}
+
+//Elements and mass fractions of a sample, with the absorption edges of its elements and
+//the mass attenuation either side of each edge. Copies of a sample share one composition
+//until one of them changes it, so variants that differ only in density, geometry, energy
+//or name share the composition and its cached cross sections.
+struct Composition
+{
+    vector < string > elements; //List of elements in sample (element symbols)
+    vector < float > mass_percents; //Percent of each element by weight
+
+    mutex lock; //Held while the edge cache is filled
+    atomic < unsigned > revision; //cross_section_revision of the edge cache, 0 if empty
+    vector < double > edges; //Edge energies of every element (keV), in element order
+    vector < double > below; //Mass attenuation (cm^2/g) 10 eV below each edge
+    vector < double > above; //and 10 eV above it
+    vector < atomic < bool > > evaluated; //Whether below and above are filled in yet
+
+    Composition() : revision(0) {}
+    Composition(const Composition & other) : elements(other.elements), mass_percents(other.mass_percents), revision(0) {}
+
+    double get_mass_mu(double at_energy, int print_flag) const; //Mass attenuation (cm^2/g) at an energy
+    int find_edges(); //Fill the edge list if it is out of date
+    int evaluate_edge(int k); //Fill in below and above for edge k, the first time it is needed
+};
+
+double Composition::get_mass_mu(double at_energy, int print_flag) const
+{
+    CompensatedSum accumMu; //accumulates sum part of mu value through multiplying
+
+    //Return variables for mucal
+    double retEnergy[9];
+    double xsec[11];
+    double fl_yield[4];
+    char err_msg[100];
+
+    for (int i = 0; i < elements.size();i++)
+    {
+        backend->evaluate(elements[i], at_energy, print_flag, retEnergy, xsec, fl_yield, err_msg);
+
+        accumMu.add(mass_percents[i]*xsec[3]);
+    }
+
+    return accumMu.get();
+}
+
+int Composition::find_edges()
+{
+    unsigned current = cross_section_revision.load(memory_order_acquire);
+
+    if (revision.load(memory_order_acquire) == current) return NO_ERR;
+
+    lock_guard < mutex > guard(lock);
+
+    if (revision.load(memory_order_relaxed) == current) return NO_ERR;
+
+    //Return variables for mucal
+    double retEnergy[9];
+    double xsec[11];
+    double fl_yield[4];
+    char err_msg[100];
+
+    edges.clear();
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        backend->evaluate(elements[i], 0, 0, retEnergy, xsec, fl_yield, err_msg);
+
+        for (int j = 0; j < 5; j++)
+        {
+            if (retEnergy[j] > 0) edges.push_back(retEnergy[j]);
+        }
+    }
+
+    below.assign(edges.size(), 0);
+    above.assign(edges.size(), 0);
+    evaluated = vector < atomic < bool > > (edges.size());
+
+    revision.store(current, memory_order_release);
+
+    return NO_ERR;
+}
+
+int Composition::evaluate_edge(int k)
+{
+    if (evaluated[k].load(memory_order_acquire)) return NO_ERR;
+
+    lock_guard < mutex > guard(lock);
+
+    if (evaluated[k].load(memory_order_relaxed)) return NO_ERR;
+
+    //Samples keep edge energies as floats, so evaluate either side of the rounded energy
+    float edge = edges[k];
+
+    below[k] = get_mass_mu(edge - 0.01, 0);
+    above[k] = get_mass_mu(edge + 0.01, 0);
+
+    evaluated[k].store(true, memory_order_release);
+
+    return NO_ERR;
+}
+
+class Sample
+{
+    private:
+
+    //User Defined
+    string name; //Name of sample
+    shared_ptr < Composition > composition; //Shared with copies until either changes it
+    float density; //Bulk density of material (g/cm^3)
+
+    Geometry geometry; //Holder the sample is sized for
+
+    //Calculated
+    float energy;
+    float mu;
+    float step_mu; //Change in mu across the edge nearest the photon energy
+    float edge; //Energy of that edge (keV)
+    float absorption_length;
+    float thickness;
+    float volume;
+    float mass;
+    vector < float > masses;
+
+    bool quiet; //Leave edge warnings to the caller instead of printing them from mucal
+
+    double compute_mu(double at_energy); //Linear absorption coefficient (1/cm) at an energy
+    Composition & edit_composition(); //The composition, first copied if it is shared
+
+    public:
+
+    Sample(string_view sample_name);
+    int compute(); //Compute xray properties at a given energy
+    int compute_from(float inp_mu, float inp_edge, float inp_step_mu); //Size the sample from known absorption
+    int dilute(string_view compound); //Dilute sample using a specified compound
+    int rename(string_view sample_name); //Change sample name
+    int write_screen(); //Write sample data to screen
+    int write_file(string_view file_name); //Write sample data to file
+    int write_json(ostream & out); //Write sample data as a JSON object
+    int write_row(ColumnBlock * block, size_t row); //Store sample results as one labelled block row
+    int compute_dilution(float percent); //Computes BN dilution of a sample and resulting effect on absorption length
+    size_t count_near_edge(const vector < double > & energies); //Energies within 1 eV of an edge of any element
+
+    //Getters return references to the sample's own data, valid until it is next changed
+    const string & get_name() const;
+    int get_num_elements() const;
+    double get_energy() const;
+    float get_density() const;
+    float get_mu() const;
+    float get_step_mu() const;
+    float get_edge() const;
+    float get_thickness() const; //Pellet thickness (cm) from the last compute
+    const Geometry & get_geometry() const;
+    const vector < string > & get_elements() const;
+    const vector < float > & get_mass_percents() const;
+
+    //Setters copy into the sample's existing storage, so a sample that is set up again
+    //and again reuses its buffers; the && overloads take over the caller's buffers
+    int set_name(string_view new_name);
+    int set_energy(float inp_energy);
+    int set_density(float inp_density);
+    int set_geometry(const Geometry & inp_geometry);
+    int set_quiet(bool inp_quiet);
+    int set_elements(const vector < string > & inp_elements);
+    int set_elements(vector < string > && inp_elements);
+    int set_num_elements(int num);
+    int set_mass_percents(const vector < float > & inp_mass_percents);
+    int set_mass_percents(vector < float > && inp_mass_percents);
+
+    bool shares_composition(const Sample & other) const;
+};
+
+Sample::Sample(string_view sample_name) : name(sample_name), composition(make_shared < Composition > ()), geometry("die_13mm")
+{
+    density = 0;
+    energy = 0;
+    thickness = 0;
+    quiet = false;
+}
+
+const string & Sample::get_name() const
+{
+    return name;
+}
+
+double Sample::get_energy() const
+{
+    return energy;
+}
+
+int Sample::get_num_elements() const
+{
+    return composition->elements.size();
+}
+
+float Sample::get_density() const
+{
+    return density;
+}
+
+float Sample::get_mu() const
+{
+    return mu;
+}
+
+float Sample::get_step_mu() const
+{
+    return step_mu;
+}
+
+float Sample::get_edge() const
+{
+    return edge;
+}
+
+float Sample::get_thickness() const
+{
+    return thickness;
+}
+
+const Geometry & Sample::get_geometry() const
+{
+    return geometry;
+}
+
+const vector < string > & Sample::get_elements() const
+{
+    return composition->elements;
+}
+
+const vector < float > & Sample::get_mass_percents() const
+{
+    return composition->mass_percents;
+}
+
+bool Sample::shares_composition(const Sample & other) const
+{
+    return composition == other.composition;
+}
+
+Composition & Sample::edit_composition()
+{
+    if (composition.use_count() > 1) composition = make_shared < Composition > (*composition);
+
+    //Any cached edges are for the old composition
+    composition->revision.store(0, memory_order_relaxed);
+
+    return *composition;
+}
+
+int Sample::set_energy(float inp_energy)
+{
+    energy = inp_energy;
+    return NO_ERR;
+}
+
+int Sample::set_density(float inp_density)
+{
+    density = inp_density;
+    return NO_ERR;
+}
+
+int Sample::set_geometry(const Geometry & inp_geometry)
+{
+    geometry = inp_geometry;
+    return NO_ERR;
+}
+
+int Sample::set_quiet(bool inp_quiet)
+{
+    quiet = inp_quiet;
+    return NO_ERR;
+}
+
+int Sample::set_elements(const vector < string > & inp_elements)
+{
+    edit_composition().elements = inp_elements;
+    return NO_ERR;
+}
+
+int Sample::set_elements(vector < string > && inp_elements)
+{
+    edit_composition().elements = move(inp_elements);
+    return NO_ERR;
+}
+
+int Sample::set_num_elements(int num)
+{
+    Composition & edited = edit_composition();
+
+    edited.elements.resize(num);
+    edited.mass_percents.resize(num);
+    masses.resize(num);
+    return NO_ERR;
+}
+
+int Sample::set_name(string_view new_name)
+{
+    name = new_name;
+    return NO_ERR;
+}
+
+int Sample::set_mass_percents(const vector < float > & inp_mass_percents)
+{
+    edit_composition().mass_percents = inp_mass_percents;
+    return NO_ERR;
+}
+
+int Sample::set_mass_percents(vector < float > && inp_mass_percents)
+{
+    edit_composition().mass_percents = move(inp_mass_percents);
+    return NO_ERR;
+}
+
+int Sample::write_screen()
+{
+    const vector < string > & elements = composition->elements;
+    const vector < float > & mass_percents = composition->mass_percents;
+    cout << endl << "------------------------------------" << endl << endl;
+    cout << "Sample Name: " << name << endl << endl;
+    cout << "Sample Composition:" << endl << endl;
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        cout << setprecision(5) << mass_percents[i] << "  " << elements[i] << endl;
+    }
+
+    cout << endl;
+
+    cout << "Photon Energy (keV): " << energy << endl;
+    cout << "Absorption Coefficient (1/cm): " << mu << endl;
+    cout << "Absorption Length (microns): " << absorption_length << endl;
+    cout << "Edge Step per Micron (near " << edge << " keV): " << step_mu / 10000 << endl << endl;
+    cout << "Pellet Density (g/cm^3): " << density << endl;
+    cout << "Pellet Geometry: " << geometry.get_name() << " (" << geometry.get_description() << ")" << endl;
+    cout << "Pellet Thickness (microns): " << thickness * 10000 << endl;
+    cout << "Pellet Volume (cm^3): " << volume << endl;
+    cout << "Pellet Mass (g): " << mass << endl;
+    cout << endl << "Pellet Masses by Element (g): " << endl << endl;
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        cout << setprecision(5) << masses[i] << "  " << elements[i] << endl;
+    }
+
+    cout << endl << "------------------------------------" << endl;
+    cout << endl;
+
+    return NO_ERR;
+}
+
+int Sample::write_file(string_view file_name)
+{
+    const vector < string > & elements = composition->elements;
+    const vector < float > & mass_percents = composition->mass_percents;
+    ofstream file;
+    string path = "samples/";
+
+    path.append(file_name);
+    path.append(".txt");
+
+    file.open(path.c_str(), fstream::app);
+
+    file << endl << "------------------------------------" << endl << endl;
+    file << "Sample Name: " << name << endl << endl;
+    file << "Sample Composition:" << endl << endl;
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        file << setprecision(5) << mass_percents[i] << "  " << elements[i] << endl;
+    }
+
+    file << endl;
+
+    file << "Photon Energy (keV): " << energy << endl;
+    file << "Absorption Coefficient (1/cm): " << mu << endl;
+    file << "Absorption Length (microns): " << absorption_length << endl;
+    file << "Edge Step per Micron (near " << edge << " keV): " << step_mu / 10000 << endl << endl;
+    file << "Pellet Density (g/cm^3): " << density << endl;
+    file << "Pellet Geometry: " << geometry.get_name() << " (" << geometry.get_description() << ")" << endl;
+    file << "Pellet Thickness (microns): " << thickness * 10000 << endl;
+    file << "Pellet Volume (cm^3): " << volume << endl;
+    file << "Pellet Mass (g): " << mass << endl;
+    file << endl << "Pellet Masses by Element (g): " << endl << endl;
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        file << setprecision(5) << masses[i] << "  " << elements[i] << endl;
+    }
+
+    file << endl << "------------------------------------" << endl;
+    file << endl;
+
+    file.close();
+
+    return NO_ERR;
+}
+
+int Sample::write_row(ColumnBlock * block, size_t row)
+{
+    double values[] = {energy, density, mu, absorption_length, edge, step_mu, thickness * 10000, mass};
+
+    block->labels[row] = name;
+
+    for (int col = 0; col < 8; col++) block->columns[col][row] = values[col];
+
+    return NO_ERR;
+}
+
+//Quotes text as a JSON string, escaping quotes, backslashes and control characters
+string json_string(string_view text)
+{
+    string quoted = "\"";
+    char escape[8];
+
+    for (int i = 0; i < text.size(); i++)
+    {
+        unsigned char c = text[i];
+
+        if (c == '"' || c == '\\')
+        {
+            quoted.push_back('\\');
+            quoted.push_back(c);
+        }
+        else if (c < 0x20)
+        {
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted.append(escape);
+        }
+        else
+        {
+            quoted.push_back(c);
+        }
+    }
+
+    quoted.push_back('"');
+
+    return quoted;
+}
+
+//Formats a number for JSON, which has no NaN or infinity, so those become null
+string json_number(double value)
+{
+    char text[32];
+
+    if (!isfinite(value)) return "null";
+
+    snprintf(text, sizeof(text), "%.6g", value);
+
+    return text;
+}
+
+int Sample::write_json(ostream & out)
+{
+    const vector < string > & elements = composition->elements;
+    const vector < float > & mass_percents = composition->mass_percents;
+
+    out << "{\"name\": " << json_string(name) << ", ";
+    out << "\"energy_kev\": " << json_number(energy) << ", ";
+    out << "\"mu_1_cm\": " << json_number(mu) << ", ";
+    out << "\"absorption_length_um\": " << json_number(absorption_length) << ", ";
+    out << "\"edge_kev\": " << json_number(edge) << ", ";
+    out << "\"step_mu_1_cm\": " << json_number(step_mu) << ", ";
+    out << "\"density_g_cm3\": " << json_number(density) << ", ";
+    out << "\"geometry\": " << json_string(geometry.get_description()) << ", ";
+    out << "\"thickness_um\": " << json_number(thickness * 10000) << ", ";
+    out << "\"volume_cm3\": " << json_number(volume) << ", ";
+    out << "\"mass_g\": " << json_number(mass) << ", ";
+    out << "\"composition\": [";
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        out << (i ? ", " : "") << "{\"element\": " << json_string(elements[i]) << ", \"mass_fraction\": " << json_number(mass_percents[i])
+            << ", \"mass_g\": " << json_number(masses[i]) << "}";
+    }
+
+    out << "]}" << endl;
+
+    return NO_ERR;
+}
+
+int Sample::compute_dilution(float percent)
+{
+    TraceSpan span("dilution");
+
+    Composition & diluted = edit_composition();
+    vector < string > & elements = diluted.elements;
+    vector < float > & mass_percents = diluted.mass_percents;
+
+    int b_index;
+    int n_index;
+
+    //Search if B or N is already in sample and assign index appropriately
+    if (find(elements.begin(), elements.end(), "B") != elements.end())
+    {
+        b_index = distance(elements.begin(), find(elements.begin(), elements.end(), "B"));
+    }
+    else
+    {
+        elements.push_back("B");
+        mass_percents.push_back(0);
+        masses.push_back(0);
+        b_index = elements.size() - 1;
+    }
+
+    if (find(elements.begin(), elements.end(), "N") != elements.end())
+    {
+        n_index = distance(elements.begin(), find(elements.begin(), elements.end(), "N"));
+    }
+    else
+    {
+        elements.push_back("N");
+        mass_percents.push_back(0);
+        masses.push_back(0);
+        n_index = elements.size() - 1;
+    }
+
+    //Reduce percents of all other elements
+    for (int i = 0; i < elements.size(); i++)
+    {
+        if (i != b_index && i != n_index)
+        {
+            mass_percents[i] *= 1 - percent;
+        }
+    }
+
+    //set B and N mass percents
+    mass_percents[b_index] = 0.436*percent;
+    mass_percents[n_index] = 0.564*percent;
+
+    //adjust new total density
+    density = density*(1 - percent) + 2.29*percent;
+
+    return NO_ERR;
+}
+
+double Sample::compute_mu(double at_energy)
+{
+    //multiply in density
+    return composition->get_mass_mu(at_energy, quiet ? 0 : 1) * density;
+}
+
+//mucal warns that its fits may be inaccurate this close to an edge. Energies are
+//compared as the float the sample keeps them in.
+size_t Sample::count_near_edge(const vector < double > & energies)
+{
+    Composition & data = *composition;
+    size_t count = 0;
+
+    data.find_edges();
+
+    for (size_t e = 0; e < energies.size(); e++)
+    {
+        float at_energy = energies[e];
+
+        for (int k = 0; k < data.edges.size(); k++)
+        {
+            if (fabs(data.edges[k] - at_energy) <= 0.001)
+            {
+                count++;
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+int Sample::compute()
+{
+    Composition & data = *composition;
+
+    mu = compute_mu(energy);
+
+    //Find the absorption edge of any element closest to the photon energy
+    data.find_edges();
+
+    edge = 0;
+    int nearest = -1;
+
+    for (int k = 0; k < data.edges.size(); k++)
+    {
+        if (fabs(data.edges[k] - energy) < fabs(edge - energy))
+        {
+            edge = data.edges[k];
+            nearest = k;
+        }
+    }
+
+    //Evaluated 10 eV either side of the edge, clear of the fit discontinuity
+    step_mu = 0;
+    if (edge > 0.01)
+    {
+        data.evaluate_edge(nearest);
+        step_mu = data.above[nearest] * density - data.below[nearest] * density;
+    }
+
+    return compute_from(mu, edge, step_mu);
+}
+
+int Sample::compute_from(float inp_mu, float inp_edge, float inp_step_mu)
+{
+    mu = inp_mu;
+    edge = inp_edge;
+    step_mu = inp_step_mu;
+
+    absorption_length = (1 / mu) * 10000; //Absorption length in microns
+
+    int err = geometry.get_thickness(mu, step_mu, &thickness); //Thickness in cm
+
+    volume = geometry.get_area() * thickness; //Volume in cm^3
+
+    mass = volume * density; //Total mass of pellet
+
+    for (int i = 0; i < composition->elements.size(); i++)
+    {
+        masses[i] = composition->mass_percents[i] * (volume * density); //Compute each mass needed to form pellet
+    }
+
+    return err;
+}
+
+//Computes the pellet mass of every sample for every geometry in one pass. Each sample
+//is evaluated once; only the thickness target and area change between geometries.
+int compute_masses(vector < Sample > & batch, vector < Geometry > & geometries, string file_name)
+{
+    ofstream file(("samples/" + string(file_name) + ".csv").c_str());
+
+    if (!file) return BAD_INPUT;
+
+    file << "sample,geometry,energy_kev,mu_1_cm,step_mu_1_cm,thickness_um,pellet_mass_g" << endl;
+
+    for (int i = 0; i < batch.size(); i++)
+    {
+        //Skip samples that have not been set up and given an energy
+        if (batch[i].get_num_elements() == 0 || batch[i].get_energy() <= 0) continue;
+
+        batch[i].compute();
+
+        for (int j = 0; j < geometries.size(); j++)
+        {
+            float thickness;
+
+            if (geometries[j].get_thickness(batch[i].get_mu(), batch[i].get_step_mu(), &thickness) != NO_ERR)
+            {
+                cout << "No absorption edge near " << batch[i].get_energy() << " keV to size " << batch[i].get_name()
+                     << " for geometry " << geometries[j].get_name() << "; skipped." << endl;
+                continue;
+            }
+
+            float mass = geometries[j].get_area() * thickness * batch[i].get_density();
+
+            file << batch[i].get_name() << "," << geometries[j].get_name() << "," << batch[i].get_energy() << ","
+                 << batch[i].get_mu() << "," << batch[i].get_step_mu() << "," << thickness * 10000 << "," << mass << endl;
+        }
+    }
+
+    file.close();
+
+    return NO_ERR;
+}
+
+//Parses a chemical formula such as Fe2O3, Ca(OH)2 or Fe0.5Ni0.5 into element symbols
+//and mass fractions, using mucal's atomic weights (or the backend's, for elements
+//mucal has no data for). Returns BAD_INPUT for a symbol that is not an element and
+//NO_DATA for an element with no atomic weight.
+int parse_formula(string formula, vector < string > * elements, vector < float > * mass_percents)
+{
+    vector < string > symbols;
+    vector < double > counts;
+    vector < size_t > group_starts; //Index into 'symbols' where each open bracket starts
+    size_t pos = 0;
+
+    while (pos < formula.size())
+    {
+        char c = formula[pos];
+        size_t first = symbols.size();
+
+        if (c == '(')
+        {
+            group_starts.push_back(symbols.size());
+            pos++;
+            continue;
+        }
+        else if (c == ')')
+        {
+            if (group_starts.size() == 0) return BAD_INPUT;
+
+            first = group_starts.back();
+            group_starts.pop_back();
+            pos++;
+        }
+        else if (isupper(c))
+        {
+            size_t end = pos + 1;
+            if (end < formula.size() && islower(formula[end])) end++;
+
+            symbols.push_back(formula.substr(pos, end - pos));
+            counts.push_back(1);
+            pos = end;
+        }
+        else
+        {
+            return BAD_INPUT;
+        }
+
+        //Optional multiplier for the element or bracketed group
+        size_t end = pos;
+        while (end < formula.size() && (isdigit(formula[end]) || formula[end] == '.')) end++;
+
+        if (end > pos)
+        {
+            double multiplier = atof(formula.substr(pos, end - pos).c_str());
+            for (size_t i = first; i < symbols.size(); i++) counts[i] *= multiplier;
+            pos = end;
+        }
+    }
+
+    if (symbols.size() == 0 || group_starts.size() != 0) return BAD_INPUT;
+
+    //Combine repeated elements and convert amounts to mass
+    elements->clear();
+    vector < double > masses;
+    CompensatedSum total;
+
+    for (int i = 0; i < symbols.size(); i++)
+    {
+        char elemName[3];
+        strncpy(elemName, symbols[i].c_str(), 2);
+        elemName[2] = 0;
+
+        int Z = name_z(elemName);
+        double weight = 0;
+
+        if (Z == 0) return BAD_INPUT;
+        if (Z <= atomic_weights().get_size()) weight = atomic_weights()[Z];
+
+        if (weight <= 0)
+        {
+            double retEnergy[9];
+            double xsec[11];
+            double fl_yield[4];
+            char err_msg[100];
+
+            if (backend->evaluate(symbols[i], 0, 0, retEnergy, xsec, fl_yield, err_msg) == no_error) weight = xsec[6];
+        }
+
+        if (counts[i] <= 0) return BAD_INPUT;
+        if (weight <= 0) return NO_DATA;
+
+        int k = distance(elements->begin(), find(elements->begin(), elements->end(), symbols[i]));
+
+        if (k == elements->size())
+        {
+            elements->push_back(symbols[i]);
+            masses.push_back(0);
+        }
+
+        masses[k] += counts[i] * weight;
+        total.add(counts[i] * weight);
+    }
+
+    mass_percents->clear();
+
+    for (int k = 0; k < masses.size(); k++) mass_percents->push_back(masses[k] / total.get());
+
+    return NO_ERR;
+}
+
+//Explodes a string
+void string_explode(const string & str, const string & separator, vector< string > * results){
+    size_t start = 0;
+    size_t found = str.find_first_of(separator);
+
+    //Tokens are copied straight out of the input, without copying what is left of it
+    while(found != string::npos){
+        if(found > start){
+            results->push_back(str.substr(start, found - start));
+        }
+
+        start = found + 1;
+        found = str.find_first_of(separator, start);
+    }
+    if(start < str.length()){
+        results->push_back(str.substr(start));
+    }
+}
+
+//Splits a line into the words between any of the separator characters. The words point
+//into the line, so they are only valid while it is.
+void string_tokenize(string_view str, string_view separators, vector < string_view > * results)
+{
+    size_t start = str.find_first_not_of(separators);
+
+    while (start != string_view::npos)
+    {
+        size_t end = str.find_first_of(separators, start);
+
+        if (end == string_view::npos) end = str.size();
+
+        results->push_back(str.substr(start, end - start));
+        start = str.find_first_not_of(separators, end);
+    }
+}
+
+//Handles one console command. Receives every word of the line, the command words first.
+typedef function < int (const vector < string_view > &) > CommandHandler;
+
+//Console commands, looked up by their first one or two words. A command registered
+//with one word takes the rest of the line as arguments; one registered with two words
+//(e.g. "sample compute") belongs to the group named by the first, and a line naming a
+//group but none of its commands is reported as a bad subcommand. Commands are listed in
+//help in the order they were added, so other parts of the program can add their own.
+class CommandTable
+{
+    private:
+
+    struct Command
+    {
+        string group;
+        string name; //Empty for one-word commands
+        string usage;
+        string help;
+        CommandHandler handler;
+    };
+
+    vector < Command > commands;
+    map < uint64_t, size_t > index; //Hash of the command words to position in commands
+    set < uint64_t > groups;
+    vector < string_view > words; //Reused for every line
+
+    static uint64_t hash(string_view group, string_view name);
+    const Command * find(const vector < string_view > & line_words) const;
+
+    public:
+
+    int add(string_view command, string_view usage, string_view help, CommandHandler handler);
+    int run(string_view line);
+    int write_help() const;
+    int bad_subcommand(string_view group) const;
+};
+
+uint64_t CommandTable::hash(string_view group, string_view name)
+{
+    uint64_t result = fnv1a(group.data(), group.size());
+
+    if (name.size()) result = fnv1a(name.data(), name.size(), fnv1a(" ", 1, result));
+
+    return result;
+}
+
+//Registers a command under one or two words. Returns BAD_INPUT if the words are taken.
+int CommandTable::add(string_view command, string_view usage, string_view help, CommandHandler handler)
+{
+    vector < string_view > command_words;
+    string_tokenize(command, " ", &command_words);
+
+    if (command_words.size() < 1 || command_words.size() > 2) return BAD_INPUT;
+
+    Command entry;
+    entry.group = command_words[0];
+    if (command_words.size() == 2) entry.name = command_words[1];
+    entry.usage = usage;
+    entry.help = help;
+    entry.handler = move(handler);
+
+    uint64_t key = hash(entry.group, entry.name);
+
+    if (index.count(key)) return BAD_INPUT;
+
+    index[key] = commands.size();
+    if (entry.name.size()) groups.insert(hash(entry.group, ""));
+
+    commands.push_back(move(entry));
+
+    return NO_ERR;
+}
+
+//Two-word commands take precedence over a one-word command of the same group
+const CommandTable::Command * CommandTable::find(const vector < string_view > & line_words) const
+{
+    for (size_t n = min(line_words.size(), (size_t) 2); n > 0; n--)
+    {
+        string_view name = (n == 2) ? line_words[1] : string_view();
+        map < uint64_t, size_t >::const_iterator found = index.find(hash(line_words[0], name));
+
+        if (found == index.end()) continue;
+
+        const Command & command = commands[found->second];
+
+        if (command.group == line_words[0] && command.name == name) return &command;
+    }
+
+    return NULL;
+}
+
+//Runs the command on a line and returns what its handler does. Blank lines are ignored.
+int CommandTable::run(string_view line)
+{
+    words.clear();
+    string_tokenize(line, " \t\r", &words);
+
+    if (words.size() == 0) return NO_ERR;
+
+    const Command * command = find(words);
+
+    if (command != NULL) return command->handler(words);
+
+    if (groups.count(hash(words[0], ""))) return bad_subcommand(words[0]);
+
+    cout << "Bad command name. Please re-input." << endl;
+
+    return NO_ERR;
+}
+
+int CommandTable::bad_subcommand(string_view group) const
+{
+    cout << "Bad subcommand under command '" << group << "' -- Please re-input." << endl;
+
+    return BAD_INPUT;
+}
+
+//Usages up to 21 characters share a line with their help text
+int CommandTable::write_help() const
+{
+    cout << "List of available commands:" << endl << endl;
+
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        if (commands[i].help.size() == 0) continue;
+
+        if (commands[i].usage.size() < 22)
+        {
+            cout << left << setw(22) << commands[i].usage << right << "---" << commands[i].help << endl;
+        }
+        else
+        {
+            cout << commands[i].usage << endl << string(22, ' ') << "---" << commands[i].help << endl;
+        }
+    }
+
+    return NO_ERR;
+}
+
+//Runs numbered tasks on a set of worker threads. Tasks are dealt out round robin,
+//so the pool works through them roughly in number order; a worker that runs out
+//takes the lowest numbered task left in another worker's queue, so one long job
+//cannot leave the rest of the pool idle and ordered output is not held up. With
+//stealing off this is a plain static partition. Tasks must write their results to
+//slots indexed by task number (or an AsyncWriter), which keeps output order
+//independent of scheduling.
+class Scheduler
+{
+    private:
+
+    struct Queue
+    {
+        mutex lock;
+        deque < size_t > tasks;
+    };
+
+    int num_threads;
+    bool stealing;
+
+    public:
+
+    Scheduler(int threads, bool steal);
+    int run(size_t num_tasks, const function < void (size_t) > & task);
+
+    static int get_worker(); //Index of the worker running the calling task, 0 to threads-1
+};
+
+thread_local int scheduler_worker = 0;
+
+int Scheduler::get_worker()
+{
+    return scheduler_worker;
+}
+
+Scheduler::Scheduler(int threads, bool steal)
+{
+    num_threads = max(1, threads);
+    stealing = steal;
+}
+
+int Scheduler::run(size_t num_tasks, const function < void (size_t) > & task)
+{
+    int num_workers = min((size_t) num_threads, max((size_t) 1, num_tasks));
+    vector < Queue > queues(num_workers);
+
+    for (size_t id = 0; id < num_tasks; id++) queues[id % num_workers].tasks.push_back(id);
+
+    auto work = [&](int w)
+    {
+        if (w > 0) Tracer::set_lane(w);
+        scheduler_worker = w;
+
+        while (true)
+        {
+            size_t id;
+            bool found = false;
+
+            //Own tasks first, then the oldest task of the next non-empty queue
+            for (int k = 0; k < num_workers && !found; k++)
+            {
+                Queue & queue = queues[(w + k) % num_workers];
+                lock_guard < mutex > guard(queue.lock);
+
+                if (queue.tasks.size() != 0)
+                {
+                    id = queue.tasks.front();
+                    queue.tasks.pop_front();
+                    found = true;
+                }
+
+                if (!stealing) break;
+            }
+
+            if (!found) break;
+
+            task(id);
+        }
+    };
+
+    vector < thread > workers;
+
+    for (int w = 1; w < num_workers; w++) workers.push_back(thread(work, w));
+
+    work(0);
+
+    for (int w = 0; w < workers.size(); w++) workers[w].join();
+
+    return NO_ERR;
+}
+
+//Parses an axis definition into a list of values. Each token is either a single
+//value or a 'start:stop:count' range of evenly spaced values.
+int parse_axis(string definition, vector < double > * values)
+{
+    vector < string > tokens;
+    string_explode(definition, " ,", &tokens);
+
+    values->clear();
+
+    for (int i = 0; i < tokens.size(); i++)
+    {
+        vector < string > range;
+        string_explode(tokens[i], ":", &range);
+
+        if (range.size() == 1)
+        {
+            values->push_back(atof(range[0].c_str()));
+        }
+        else if (range.size() == 3)
+        {
+            double start = atof(range[0].c_str());
+            double stop = atof(range[1].c_str());
+            int count = atoi(range[2].c_str());
+
+            if (count < 1) return BAD_INPUT;
+
+            for (int j = 0; j < count; j++)
+            {
+                values->push_back(count == 1 ? start : start + (stop - start) * j / (count - 1));
+            }
+        }
+        else
+        {
+            return BAD_INPUT;
+        }
+    }
+
+    if (values->size() == 0) return BAD_INPUT;
+
+    return NO_ERR;
+}
+
+//Parses an axis of photon energies, which must all be positive and finite
+int parse_energies(string definition, vector < double > * energies)
+{
+    if (parse_axis(definition, energies) != NO_ERR) return BAD_INPUT;
+
+    for (int i = 0; i < energies->size(); i++)
+    {
+        if (!((*energies)[i] > 0 && (*energies)[i] < HUGE_VAL)) return BAD_INPUT;
+    }
+
+    return NO_ERR;
+}
+
+//Destination for computed column blocks. header() is given the column names and
+//whether the first of them is a row label column; every row format() writes then has a
+//label (empty if its block has none) exactly when it is. format() turns a block into
+//the bytes the sink will store and may run on any thread; write() and close() are only
+//called from the writer thread.
+class OutputSink
+{
+    protected:
+
+    ostream * out;
+    bool labelled; //Rows start with their label, as given to header()
+
+    public:
+
+    OutputSink(ostream * inp_out) : out(inp_out), labelled(false) {}
+    virtual ~OutputSink() {}
+    virtual int header(const vector < string > & names, bool labels, string * data) = 0;
+    virtual int format(const ColumnBlock & block, string * data) = 0;
+    virtual int write(const string & data);
+    virtual int close();
+};
+
+int OutputSink::write(const string & data)
+{
+    out->write(data.data(), data.size());
+    return out->good() ? NO_ERR : BAD_INPUT;
+}
+
+int OutputSink::close()
+{
+    out->flush();
+    return out->good() ? NO_ERR : BAD_INPUT;
+}
+
+//Comma separated values with a header row
+class CsvSink : public OutputSink
+{
+    public:
+
+    CsvSink(ostream * inp_out) : OutputSink(inp_out) {}
+    int header(const vector < string > & names, bool labels, string * data);
+    int format(const ColumnBlock & block, string * data);
+};
+
+int CsvSink::header(const vector < string > & names, bool labels, string * data)
+{
+    labelled = labels;
+
+    for (int i = 0; i < names.size(); i++)
+    {
+        data->append(names[i]);
+        data->push_back(i + 1 < names.size() ? ',' : '\n');
+    }
+
+    return NO_ERR;
+}
+
+int CsvSink::format(const ColumnBlock & block, string * data)
+{
+    if (block.comment.size()) data->append("# " + block.comment + "\n");
+
+    format_columns(block, 0, block.rows, labelled, data);
+    return NO_ERR;
+}
+
+//Fixed width columns for reading on screen
+class TextSink : public OutputSink
+{
+    public:
+
+    TextSink(ostream * inp_out) : OutputSink(inp_out) {}
+    int header(const vector < string > & names, bool labels, string * data);
+    int format(const ColumnBlock & block, string * data);
+};
+
+int TextSink::header(const vector < string > & names, bool labels, string * data)
+{
+    char cell[64];
+
+    labelled = labels;
+
+    for (int i = 0; i < names.size(); i++)
+    {
+        snprintf(cell, sizeof(cell), "%-22s", names[i].c_str());
+        data->append(cell);
+    }
+
+    data->push_back('\n');
+
+    return NO_ERR;
+}
+
+int TextSink::format(const ColumnBlock & block, string * data)
+{
+    char cell[64];
+
+    if (block.comment.size()) data->append("# " + block.comment + "\n");
+
+    for (size_t row = 0; row < block.rows; row++)
+    {
+        if (labelled)
+        {
+            snprintf(cell, sizeof(cell), "%-22s", block.labels.size() ? block.labels[row].c_str() : "");
+            data->append(cell);
+        }
+
+        for (size_t col = 0; col < block.get_num_columns(); col++)
+        {
+            snprintf(cell, sizeof(cell), "%-22.7g", block.get(col, row));
+            data->append(cell);
+        }
+
+        data->push_back('\n');
+    }
+
+    return NO_ERR;
+}
+
+//Binary columnar output. The stream starts with "XSCOLS1" and a NUL, the number of
+//value columns and whether rows are labelled (uint32 each), then every column name as
+//a uint32 length and its bytes. Each block is a uint64 row count, the row labels (if
+//rows are labelled) as length and bytes, then each value column as 'rows' native doubles.
+class BinarySink : public OutputSink
+{
+    public:
+
+    BinarySink(ostream * inp_out) : OutputSink(inp_out) {}
+    int header(const vector < string > & names, bool labels, string * data);
+    int format(const ColumnBlock & block, string * data);
+};
+
+void append_binary(string * data, const void * value, size_t size)
+{
+    data->append((const char *) value, size);
+}
+
+void append_binary(string * data, const string & value)
+{
+    uint32_t size = value.size();
+    append_binary(data, &size, sizeof(size));
+    data->append(value);
+}
+
+int BinarySink::header(const vector < string > & names, bool labels, string * data)
+{
+    uint32_t num_columns = names.size() - (labels ? 1 : 0);
+    uint32_t has_labels = labels;
+
+    labelled = labels;
+
+    append_binary(data, "XSCOLS1", 8);
+    append_binary(data, &num_columns, sizeof(num_columns));
+    append_binary(data, &has_labels, sizeof(has_labels));
+
+    for (int i = 0; i < names.size(); i++) append_binary(data, names[i]);
+
+    return NO_ERR;
+}
+
+int BinarySink::format(const ColumnBlock & block, string * data)
+{
+    uint64_t rows = block.rows;
+
+    if (rows == 0) return NO_ERR;
+
+    append_binary(data, &rows, sizeof(rows));
+
+    static const string no_label;
+
+    for (size_t row = 0; labelled && row < rows; row++) append_binary(data, block.labels.size() ? block.labels[row] : no_label);
+
+    for (size_t col = 0; col < block.columns.size(); col++)
+    {
+        append_binary(data, block.columns[col].data(), rows * sizeof(double));
+    }
+
+    //Float columns are stored as doubles like the rest
+    for (size_t col = 0; col < block.float_columns.size(); col++)
+    {
+        for (size_t row = 0; row < rows; row++)
+        {
+            double value = block.float_columns[col][row];
+            append_binary(data, &value, sizeof(value));
+        }
+    }
+
+    return NO_ERR;
+}
+
+//Returns a new sink for a format name (csv, text or binary), or NULL
+OutputSink * make_sink(string format, ostream * out)
+{
+    if (format == "csv") return new CsvSink(out);
+    if (format == "text") return new TextSink(out);
+    if (format == "binary") return new BinarySink(out);
+    return NULL;
+}
+
+//Checksums the bytes another sink produces in fixed size chunks, so two runs can be
+//compared with memory proportional to the number of chunks rather than the output.
+//With 'store' set the bytes are also written through the other sink; otherwise only
+//its header() and format() are used.
+class ChecksumSink : public OutputSink
+{
+    private:
+
+    OutputSink * sink;
+    bool store;
+    uint64_t checksum; //Of the bytes so far in the current chunk
+    size_t chunk_bytes;
+
+    public:
+
+    static const size_t CHUNK_SIZE = 1 << 16;
+    vector < uint64_t > checksums; //One per complete chunk, then one for the rest
+    size_t num_bytes;
+
+    ChecksumSink(OutputSink * inp_sink, bool inp_store);
+    bool matches(const ChecksumSink & other, size_t * first_difference) const; //After both are closed
+    int header(const vector < string > & names, bool labels, string * data);
+    int format(const ColumnBlock & block, string * data);
+    int write(const string & data);
+    int close();
+};
+
+ChecksumSink::ChecksumSink(OutputSink * inp_sink, bool inp_store) : OutputSink(NULL)
+{
+    sink = inp_sink;
+    store = inp_store;
+    checksum = fnv1a(NULL, 0);
+    chunk_bytes = 0;
+    num_bytes = 0;
+}
+
+//Whether two closed sinks saw the same bytes; if not, 'first_difference' is the start
+//of the first chunk that differs
+bool ChecksumSink::matches(const ChecksumSink & other, size_t * first_difference) const
+{
+    size_t num_common = min(checksums.size(), other.checksums.size());
+    size_t chunk = mismatch(checksums.begin(), checksums.begin() + num_common, other.checksums.begin()).first - checksums.begin();
+
+    *first_difference = min(chunk * CHUNK_SIZE, min(num_bytes, other.num_bytes));
+
+    return num_bytes == other.num_bytes && checksums == other.checksums;
+}
+
+int ChecksumSink::header(const vector < string > & names, bool labels, string * data)
+{
+    return sink->header(names, labels, data);
+}
+
+int ChecksumSink::format(const ColumnBlock & block, string * data)
+{
+    return sink->format(block, data);
+}
+
+int ChecksumSink::write(const string & data)
+{
+    size_t start = 0;
+
+    while (start < data.size())
+    {
+        size_t size = min(data.size() - start, CHUNK_SIZE - chunk_bytes);
+
+        checksum = fnv1a(data.data() + start, size, checksum);
+        chunk_bytes += size;
+        start += size;
+
+        if (chunk_bytes == CHUNK_SIZE)
+        {
+            checksums.push_back(checksum);
+            checksum = fnv1a(NULL, 0);
+            chunk_bytes = 0;
+        }
+    }
+
+    num_bytes += data.size();
+
+    return store ? sink->write(data) : NO_ERR;
+}
+
+int ChecksumSink::close()
+{
+    if (chunk_bytes) checksums.push_back(checksum);
+
+    checksum = fnv1a(NULL, 0);
+    chunk_bytes = 0;
+
+    return store ? sink->close() : NO_ERR;
+}
+
+//CSV output of one shard of a batch. Every row is prefixed with the index of its
+//batch job and a tab, so shards can be merged back into input order, and the file
+//ends with a checksum of all the prefixed rows:
+//    # xafsprep shard i/N
+//    <csv header>
+//    <job>\t<csv row>
+//    # checksum <hex> rows <count>
+class ShardSink : public CsvSink
+{
+    private:
+
+    int shard;
+    int num_shards;
+    uint64_t checksum;
+    size_t num_rows;
+
+    public:
+
+    ShardSink(ostream * inp_out, int inp_shard, int inp_num_shards);
+    int header(const vector < string > & names, bool labels, string * data);
+    int format(const ColumnBlock & block, string * data);
+    int write(const string & data);
+    int close();
+};
+
+ShardSink::ShardSink(ostream * inp_out, int inp_shard, int inp_num_shards) : CsvSink(inp_out)
+{
+    shard = inp_shard;
+    num_shards = inp_num_shards;
+    checksum = fnv1a(NULL, 0);
+    num_rows = 0;
+}
+
+int ShardSink::header(const vector < string > & names, bool labels, string * data)
+{
+    *data += "# xafsprep shard " + to_string(shard) + "/" + to_string(num_shards) + "\n";
+    return CsvSink::header(names, labels, data);
+}
+
+int ShardSink::format(const ColumnBlock & block, string * data)
+{
+    string rows;
+    CsvSink::format(block, &rows);
+
+    string prefix = to_string(block.job) + "\t";
+    size_t start = 0;
+
+    while (start < rows.size())
+    {
+        size_t end = rows.find('\n', start) + 1;
+
+        data->append(prefix);
+        data->append(rows, start, end - start);
+        start = end;
+    }
+
+    return NO_ERR;
+}
+
+int ShardSink::write(const string & data)
+{
+    //The header is the only write that does not start with a job index
+    if (data.size() && data[0] != '#')
+    {
+        checksum = fnv1a(data.data(), data.size(), checksum);
+        num_rows += count(data.begin(), data.end(), '\n');
+    }
+
+    return OutputSink::write(data);
+}
+
+int ShardSink::close()
+{
+    char trailer[64];
+
+    snprintf(trailer, sizeof(trailer), "# checksum %016llx rows %zu\n", (unsigned long long) checksum, num_rows);
+    OutputSink::write(trailer);
+
+    return OutputSink::close();
+}
+
+//One shard file being merged
+struct ShardReader
+{
+    ifstream file;
+    string line; //Current row, without its job prefix
+    long job; //Job index of the current row, -1 at the end
+    int shard;
+    int num_shards;
+    string header;
+
+    int open(string file_name);
+    int advance(); //Move to the next row
+};
+
+int ShardReader::open(string file_name)
+{
+    string first;
+
+    file.open(file_name.c_str());
+
+    if (!getline(file, first) || sscanf(first.c_str(), "# xafsprep shard %d/%d", &shard, &num_shards) != 2) return BAD_INPUT;
+    if (!getline(file, header)) return BAD_INPUT;
+
+    return advance();
+}
+
+int ShardReader::advance()
+{
+    string row;
+
+    job = -1;
+
+    if (!getline(file, row) || row.compare(0, 11, "# checksum ") == 0) return NO_ERR;
+
+    size_t tab = row.find('\t');
+
+    if (tab == string::npos) return BAD_INPUT;
+
+    job = atol(row.c_str());
+    line = row.substr(tab + 1);
+
+    return NO_ERR;
+}
+
+//Checks a shard file against its trailer checksum
+int verify_shard(string file_name)
+{
+    ifstream file(file_name.c_str());
+    string row;
+    uint64_t checksum = fnv1a(NULL, 0);
+    size_t num_rows = 0;
+
+    getline(file, row);
+    getline(file, row);
+
+    while (getline(file, row))
+    {
+        if (row.compare(0, 11, "# checksum ") == 0)
+        {
+            unsigned long long expected;
+            size_t expected_rows;
+
+            if (sscanf(row.c_str(), "# checksum %llx rows %zu", &expected, &expected_rows) != 2) return BAD_INPUT;
+
+            return (expected == checksum && expected_rows == num_rows) ? NO_ERR : BAD_INPUT;
+        }
+
+        row.push_back('\n');
+        checksum = fnv1a(row.data(), row.size(), checksum);
+        num_rows++;
+    }
+
+    //No trailer: the shard did not finish
+    return BAD_INPUT;
+}
+
+//Merges the shard files of one batch into a single CSV in input order. Every shard
+//must be present exactly once and pass its checksum before anything is written.
+int merge_shards(string output_file, vector < string > & shard_files)
+{
+    vector < ShardReader > readers(shard_files.size());
+    vector < bool > seen(shard_files.size(), false);
+
+    for (int i = 0; i < shard_files.size(); i++)
+    {
+        if (verify_shard(shard_files[i]) != NO_ERR)
+        {
+            cerr << "Checksum failed or shard incomplete: " << shard_files[i] << endl;
+            return BAD_INPUT;
+        }
+
+        ShardReader & reader = readers[i];
+
+        if (reader.open(shard_files[i]) != NO_ERR || reader.num_shards != shard_files.size() ||
+            reader.shard < 0 || reader.shard >= reader.num_shards || seen[reader.shard] ||
+            reader.header != readers[0].header)
+        {
+            cerr << "Not a matching shard of this batch: " << shard_files[i] << endl;
+            return BAD_INPUT;
+        }
+
+        seen[reader.shard] = true;
+    }
+
+    ofstream file(output_file.c_str());
+
+    if (!file) return BAD_INPUT;
+
+    file << readers[0].header << "\n";
+
+    //Repeatedly take the lowest job index among the shards
+    while (true)
+    {
+        int lowest = -1;
+
+        for (int i = 0; i < readers.size(); i++)
+        {
+            if (readers[i].job >= 0 && (lowest < 0 || readers[i].job < readers[lowest].job)) lowest = i;
+        }
+
+        if (lowest < 0) break;
+
+        long job = readers[lowest].job;
+
+        while (readers[lowest].job == job)
+        {
+            file << readers[lowest].line << "\n";
+            if (readers[lowest].advance() != NO_ERR) return BAD_INPUT;
+        }
+    }
+
+    file.close();
+
+    return file ? NO_ERR : BAD_INPUT;
+}
+
+//Moves output off the compute threads. Workers format numbered blocks and hand them
+//over with push(); one writer thread stores them to every sink in number order.
+//Blocks more than 'window' ahead of the next one to be written make push() wait, so
+//memory stays bounded however slow the sinks are, while the block the writer needs
+//next is never held back. Numbers must run 0, 1, 2, ... without gaps. Blocks are
+//formatted into a ring of 'window' slots whose strings keep their capacity, so a long
+//run stops allocating output buffers once the ring has warmed up.
+class AsyncWriter
+{
+    private:
+
+    vector < OutputSink * > sinks;
+    size_t window;
+    mutex lock;
+    condition_variable changed;
+    vector < vector < string > > slots; //Formatted block number n is in slot n % window
+    vector < char > filled; //Set while a slot holds a block not yet written
+    size_t next; //Number of the next block to write
+    bool closing;
+    int err;
+    thread writer;
+
+    void drain(); //Writer thread
+
+    public:
+
+    AsyncWriter(vector < OutputSink * > inp_sinks, size_t inp_window);
+    ~AsyncWriter();
+    int open(const vector < string > & names, bool labels); //Write headers and start writing
+    int push(size_t number, const ColumnBlock & block);
+    int flush(); //Wait until every block pushed so far is stored
+    int close(); //Flush, stop the writer and flush the sinks
+};
+
+AsyncWriter::AsyncWriter(vector < OutputSink * > inp_sinks, size_t inp_window)
+{
+    sinks = inp_sinks;
+    window = max((size_t) 1, inp_window);
+    slots.assign(window, vector < string > (sinks.size()));
+    filled.assign(window, 0);
+    next = 0;
+    closing = false;
+    err = NO_ERR;
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    close();
+}
+
+int AsyncWriter::open(const vector < string > & names, bool labels)
+{
+    for (int i = 0; i < sinks.size(); i++)
+    {
+        string data;
+        sinks[i]->header(names, labels, &data);
+        if (sinks[i]->write(data) != NO_ERR) err = BAD_INPUT;
+    }
+
+    writer = thread(&AsyncWriter::drain, this);
+
+    return err;
+}
+
+int AsyncWriter::push(size_t number, const ColumnBlock & block)
+{
+    {
+        TraceSpan span("writer wait");
+        unique_lock < mutex > guard(lock);
+
+        changed.wait(guard, [&]() { return number < next + window; });
+    }
+
+    //The slot is ours until it is marked filled: the writer is done with its last block
+    vector < string > & data = slots[number % window];
+
+    {
+        TraceSpan span("format");
+
+        for (int i = 0; i < sinks.size(); i++)
+        {
+            data[i].clear();
+            sinks[i]->format(block, &data[i]);
+        }
+    }
+
+    lock_guard < mutex > guard(lock);
+
+    filled[number % window] = 1;
+    changed.notify_all();
+
+    return NO_ERR;
+}
+
+void AsyncWriter::drain()
+{
+    Tracer::set_lane(Tracer::WRITER_LANE);
+
+    unique_lock < mutex > guard(lock);
+
+    while (true)
+    {
+        changed.wait(guard, [&]() { return closing || filled[next % window]; });
+
+        if (!filled[next % window]) break;
+
+        //Sinks are written without holding the lock so workers can keep pushing
+        guard.unlock();
+
+        {
+            TraceSpan span("write");
+            vector < string > & data = slots[next % window];
+
+            for (int i = 0; i < sinks.size(); i++)
+            {
+                if (sinks[i]->write(data[i]) != NO_ERR) err = BAD_INPUT;
+            }
+        }
+
+        guard.lock();
+        filled[next % window] = 0;
+        next++;
+        changed.notify_all();
+    }
+}
+
+int AsyncWriter::flush()
+{
+    unique_lock < mutex > guard(lock);
+
+    changed.wait(guard, [&]() { return !filled[next % window]; });
+
+    return err;
+}
+
+int AsyncWriter::close()
+{
+    if (!writer.joinable()) return err;
+
+    flush();
+
+    {
+        lock_guard < mutex > guard(lock);
+        closing = true;
+        changed.notify_all();
+    }
+
+    writer.join();
+
+    for (int i = 0; i < sinks.size(); i++)
+    {
+        if (sinks[i]->close() != NO_ERR) err = BAD_INPUT;
+    }
+
+    return err;
+}
+
+//Arithmetic used by the sweep and fluorescence kernels. Float halves the memory the
+//kernels stream and doubles the lanes a vectorized loop works on, which is plenty for
+//screening; double is for final planning numbers. Cross sections always come from
+//the backend in double, and float results stay in float columns until written.
+const int PRECISION_DOUBLE = 0;
+const int PRECISION_FLOAT = 1;
+
+//The kernels run in steps of this many points. A fixed trip count lets the compiler
+//vectorize the step at -O2, where loops of unknown length are left scalar.
+const size_t KERNEL_WIDTH = 8;
+
+//Absorption of 'n' pellets that differ only in density and pellet area, at one energy
+//and dilution
+template < typename REAL >
+inline void sweep_points(const REAL * __restrict densities, const REAL * __restrict areas, REAL mass_mu, REAL dilution,
+                         size_t n, REAL * __restrict mu, REAL * __restrict length, REAL * __restrict mass)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        REAL diluted_density = densities[i] * (1 - dilution) + REAL(2.29) * dilution;
+        REAL absorption_length;
+
+        mu[i] = mass_mu * diluted_density;
+        absorption_length = 1 / mu[i]; //In cm
+        length[i] = absorption_length * 10000;
+        mass[i] = areas[i] * absorption_length * diluted_density;
+    }
+}
+
+//Evaluates a sample over the Cartesian product of energy, BN dilution, bulk density
+//and pellet radius. Rows are ordered with energy as the slowest varying axis.
+class Sweep
+{
+    private:
+
+    vector < double > energies; //Photon energies (keV)
+    vector < double > dilutions; //BN dilution fractions (0-1)
+    vector < double > densities; //Bulk density of the undiluted material (g/cm^3)
+    vector < double > radii; //Pellet radii (cm)
+
+    int num_threads;
+    bool stealing; //Use the work-stealing scheduler rather than a static split
+    size_t chunk_rows; //Rows per scheduled task
+    int precision; //PRECISION_DOUBLE or PRECISION_FLOAT
+
+    //Mass attenuation of each dilution at each energy, and the density, radius and area
+    //of each pellet in row order (radius varying fastest), filled by prepare()
+    vector < double > mass_mu;
+    vector < double > pellet_densities;
+    vector < double > pellet_radii;
+    vector < double > pellet_areas;
+    vector < float > mass_mu_float;
+    vector < float > pellet_densities_float;
+    vector < float > pellet_areas_float;
+
+    template < typename REAL >
+    void compute_rows(const vector < REAL > & mu_table, const vector < REAL > & inp_densities, const vector < REAL > & areas,
+                      size_t first, ColumnBlock * block, REAL * mu, REAL * length, REAL * mass);
+
+    public:
+
+    Sweep();
+    int set_energies(vector < double > inp_energies);
+    int set_dilutions(vector < double > inp_dilutions);
+    int set_densities(vector < double > inp_densities);
+    int set_radii(vector < double > inp_radii);
+    int set_num_threads(int num);
+    int set_stealing(bool steal);
+    int set_precision(int inp_precision);
+    size_t get_num_points();
+    size_t get_num_chunks();
+
+    int prepare(const Sample & sample); //Evaluate cross sections for every energy and dilution
+    int compute_chunk(size_t chunk, ColumnBlock * block); //Rows of one chunk, after prepare()
+    int run(const Sample & sample, string_view file_name); //Compute all points and stream them to file
+};
+
+Sweep::Sweep()
+{
+    dilutions.push_back(0);
+    radii.push_back(0.65);
+    num_threads = max(1u, thread::hardware_concurrency());
+    stealing = true;
+    chunk_rows = 1 << 12;
+    precision = PRECISION_DOUBLE;
+}
+
+int Sweep::set_energies(vector < double > inp_energies)
+{
+    energies = inp_energies;
+    return NO_ERR;
+}
+
+int Sweep::set_dilutions(vector < double > inp_dilutions)
+{
+    dilutions = inp_dilutions;
+    return NO_ERR;
+}
+
+int Sweep::set_densities(vector < double > inp_densities)
+{
+    densities = inp_densities;
+    return NO_ERR;
+}
+
+int Sweep::set_radii(vector < double > inp_radii)
+{
+    radii = inp_radii;
+    return NO_ERR;
+}
+
+int Sweep::set_num_threads(int num)
+{
+    num_threads = max(1, num);
+    return NO_ERR;
+}
+
+int Sweep::set_stealing(bool steal)
+{
+    stealing = steal;
+    return NO_ERR;
+}
+
+int Sweep::set_precision(int inp_precision)
+{
+    if (inp_precision != PRECISION_DOUBLE && inp_precision != PRECISION_FLOAT) return BAD_INPUT;
+
+    precision = inp_precision;
+    return NO_ERR;
+}
+
+size_t Sweep::get_num_chunks()
+{
+    return (get_num_points() + chunk_rows - 1) / chunk_rows;
+}
+
+size_t Sweep::get_num_points()
+{
+    return energies.size() * dilutions.size() * densities.size() * radii.size();
+}
+
+int Sweep::prepare(const Sample & sample)
+{
+    TraceSpan span("compute");
+
+    if (get_num_points() == 0 || sample.get_num_elements() == 0) return BAD_INPUT;
+
+    //Every dilution uses the sample elements plus B and N, so build the
+    //composition of each dilution over a common element list
+    vector < string > elements = sample.get_elements();
+    vector < vector < double > > weights(dilutions.size());
+
+    for (int d = 0; d < dilutions.size(); d++)
+    {
+        Sample diluted = sample;
+
+        if (dilutions[d] > 0) diluted.compute_dilution(dilutions[d]);
+
+        const vector < string > & diluted_elements = diluted.get_elements();
+        const vector < float > & diluted_percents = diluted.get_mass_percents();
+
+        for (int i = 0; i < diluted_elements.size(); i++)
+        {
+            if (find(elements.begin(), elements.end(), diluted_elements[i]) == elements.end())
+            {
+                elements.push_back(diluted_elements[i]);
+            }
+        }
+
+        weights[d].assign(elements.size(), 0);
+
+        for (int i = 0; i < diluted_elements.size(); i++)
+        {
+            int k = distance(elements.begin(), find(elements.begin(), elements.end(), diluted_elements[i]));
+            weights[d][k] += diluted_percents[i];
+        }
+    }
+
+    for (int d = 0; d < dilutions.size(); d++) weights[d].resize(elements.size(), 0);
+
+    //Mass attenuation of each dilution at each energy, from per-element
+    //cross sections computed once per energy
+    size_t num_d = dilutions.size();
+    mass_mu.assign(energies.size() * num_d, 0);
+
+    vector < double > element_mu(elements.size() * energies.size());
+
+    for (int k = 0; k < elements.size(); k++)
+    {
+        backend->evaluate_mu(elements[k], energies.data(), &element_mu[k * energies.size()], energies.size());
+    }
+
+    for (size_t e = 0; e < energies.size(); e++)
+    {
+        for (size_t d = 0; d < num_d; d++)
+        {
+            CompensatedSum accum;
+            for (int k = 0; k < elements.size(); k++) accum.add(weights[d][k] * element_mu[k * energies.size() + e]);
+            mass_mu[e * num_d + d] = accum.get();
+        }
+    }
+
+    mass_mu_float.assign(mass_mu.begin(), mass_mu.end());
+
+    size_t num_pellets = densities.size() * radii.size();
+    pellet_densities.resize(num_pellets);
+    pellet_radii.resize(num_pellets);
+    pellet_areas.resize(num_pellets);
+    pellet_areas_float.resize(num_pellets);
+
+    for (size_t k = 0; k < num_pellets; k++)
+    {
+        pellet_densities[k] = densities[k / radii.size()];
+        pellet_radii[k] = radii[k % radii.size()];
+        pellet_areas[k] = PI * pellet_radii[k] * pellet_radii[k];
+        pellet_areas_float[k] = float(PI) * float(pellet_radii[k]) * float(pellet_radii[k]);
+    }
+
+    pellet_densities_float.assign(pellet_densities.begin(), pellet_densities.end());
+
+    return NO_ERR;
+}
+
+//Fills rows first.. of a block, with the computed columns written to mu, length and
+//mass in REAL. Rows run through every pellet for one energy and dilution at a time, so
+//the chunk is filled in runs over the pellets, each a branch-free kernel loop.
+template < typename REAL >
+void Sweep::compute_rows(const vector < REAL > & mu_table, const vector < REAL > & inp_densities, const vector < REAL > & areas,
+                         size_t first, ColumnBlock * block, REAL * mu, REAL * length, REAL * mass)
+{
+    size_t num_d = dilutions.size();
+    size_t num_pellets = pellet_densities.size();
+    size_t count;
+
+    for (size_t row = 0; row < block->rows; row += count)
+    {
+        size_t outer = (first + row) / num_pellets; //Energy and dilution: e * num_d + d
+        size_t k = (first + row) % num_pellets;
+        size_t e = outer / num_d;
+        size_t d = outer % num_d;
+
+        count = min(num_pellets - k, block->rows - row);
+
+        fill(&block->columns[0][row], &block->columns[0][row] + count, energies[e]);
+        fill(&block->columns[1][row], &block->columns[1][row] + count, dilutions[d]);
+        copy(&pellet_densities[k], &pellet_densities[k] + count, &block->columns[2][row]);
+        copy(&pellet_radii[k], &pellet_radii[k] + count, &block->columns[3][row]);
+
+        REAL mass_mu = mu_table[outer];
+        REAL dilution = dilutions[d];
+        size_t i = 0;
+
+        for (; i + KERNEL_WIDTH <= count; i += KERNEL_WIDTH)
+        {
+            sweep_points(inp_densities.data() + k + i, areas.data() + k + i, mass_mu, dilution, KERNEL_WIDTH,
+                         mu + row + i, length + row + i, mass + row + i);
+        }
+
+        sweep_points(inp_densities.data() + k + i, areas.data() + k + i, mass_mu, dilution, count - i,
+                     mu + row + i, length + row + i, mass + row + i);
+    }
+}
+
+int Sweep::compute_chunk(size_t chunk, ColumnBlock * block)
+{
+    size_t first = chunk * chunk_rows;
+
+    if (mass_mu.size() == 0 || first >= get_num_points()) return BAD_INPUT;
+
+    block->rows = min(chunk_rows, get_num_points() - first);
+
+    //Energy, dilution, density and radius are always double; mu, absorption length and
+    //mass are in the kernel's precision
+    if (precision == PRECISION_FLOAT)
+    {
+        block->columns.resize(4);
+        block->float_columns.resize(3);
+
+        for (int col = 0; col < 3; col++) block->float_columns[col].resize(block->rows);
+    }
+    else
+    {
+        block->columns.resize(7);
+        block->float_columns.clear();
+    }
+
+    for (int col = 0; col < block->columns.size(); col++) block->columns[col].resize(block->rows);
+
+    if (precision == PRECISION_FLOAT)
+    {
+        vector < vector < float > > & out = block->float_columns;
+        compute_rows(mass_mu_float, pellet_densities_float, pellet_areas_float, first, block, out[0].data(), out[1].data(), out[2].data());
+    }
+    else
+    {
+        vector < vector < double > > & out = block->columns;
+        compute_rows(mass_mu, pellet_densities, pellet_areas, first, block, out[4].data(), out[5].data(), out[6].data());
+    }
+
+    return NO_ERR;
+}
+
+int Sweep::run(const Sample & sample, string_view file_name)
+{
+    if (prepare(sample) != NO_ERR) return BAD_INPUT;
+
+    ofstream file(("samples/" + string(file_name) + ".csv").c_str());
+
+    if (!file) return BAD_INPUT;
+
+    const char * names[] = {"energy_kev", "dilution", "density_g_cm3", "radius_cm",
+                            "mu_1_cm", "absorption_length_um", "pellet_mass_g"};
+
+    CsvSink sink(&file);
+    AsyncWriter writer(vector < OutputSink * > (1, &sink), 4 * num_threads);
+    writer.open(vector < string > (names, names + 7), false);
+
+    Scheduler scheduler(num_threads, stealing);
+
+    //Each task computes one chunk of rows and hands it to the writer
+    scheduler.run(get_num_chunks(), [&](size_t chunk)
+    {
+        TraceSpan span("sweep chunk");
+        ColumnBlock block;
+
+        compute_chunk(chunk, &block);
+        writer.push(chunk, block);
+    });
+
+    return writer.close();
+}
+
+//Estimates fluorescence self-absorption of a sample across a scan. The sample is
+//treated as infinitely thick, so the measured EXAFS amplitude is reduced by
+//(mu_other(E) + g*mu_f) / (mu_total(E) + g*mu_f), where g = sin(incidence)/sin(exit)
+//and mu_f is the total absorption at the absorber's emission line.
+class Fluorescence
+{
+    private:
+
+    string absorber; //Element symbol of the absorbing atom
+    int shell; //0 for K-shell, 3 for L3-shell emission
+    float incidence; //Angle between beam and sample surface (degrees)
+    float exit; //Angle between sample surface and detector (degrees)
+    vector < double > energies; //Incident photon energies (keV)
+    int precision; //PRECISION_DOUBLE or PRECISION_FLOAT
+
+    template < typename REAL >
+    void compute_factors(const vector < double > & mass_total, const vector < double > & mass_absorber, double density,
+                         double g_mu_line, REAL * mu_total, REAL * mu_absorber, REAL * factor, REAL * suppression);
+
+    public:
+
+    Fluorescence();
+    int set_absorber(string symbol, char edge);
+    int set_angles(float inp_incidence, float inp_exit);
+    int set_energies(vector < double > inp_energies);
+    int set_precision(int inp_precision);
+
+    int run(const Sample & sample, string_view file_name); //Compute the scan and write it to file
+};
+
+Fluorescence::Fluorescence()
+{
+    shell = 0;
+    incidence = 45;
+    exit = 45;
+    precision = PRECISION_DOUBLE;
+}
+
+int Fluorescence::set_absorber(string symbol, char edge)
+{
+    absorber = symbol;
+    shell = (toupper(edge) == 'L') ? 3 : 0;
+    return NO_ERR;
+}
+
+int Fluorescence::set_angles(float inp_incidence, float inp_exit)
+{
+    if (inp_incidence <= 0 || inp_incidence > 90 || inp_exit <= 0 || inp_exit > 90) return BAD_INPUT;
+
+    incidence = inp_incidence;
+    exit = inp_exit;
+    return NO_ERR;
+}
+
+int Fluorescence::set_energies(vector < double > inp_energies)
+{
+    energies = inp_energies;
+    return NO_ERR;
+}
+
+int Fluorescence::set_precision(int inp_precision)
+{
+    if (inp_precision != PRECISION_DOUBLE && inp_precision != PRECISION_FLOAT) return BAD_INPUT;
+
+    precision = inp_precision;
+    return NO_ERR;
+}
+
+//Linear attenuation, amplitude factor and its suppression at 'n' energies
+template < typename REAL >
+inline void fluorescence_points(const double * __restrict mass_total, const double * __restrict mass_absorber, REAL rho, REAL g_mu,
+                                size_t n, REAL * __restrict mu_total, REAL * __restrict mu_absorber, REAL * __restrict factor,
+                                REAL * __restrict suppression)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        REAL total = REAL(mass_total[i]) * rho;
+        REAL absorber = REAL(mass_absorber[i]) * rho;
+
+        mu_total[i] = total;
+        mu_absorber[i] = absorber;
+        factor[i] = (total - absorber + g_mu) / (total + g_mu);
+        suppression[i] = 1 - factor[i];
+    }
+}
+
+//Linear attenuation and self-absorption factor at every energy, computed and stored in REAL
+template < typename REAL >
+void Fluorescence::compute_factors(const vector < double > & mass_total, const vector < double > & mass_absorber, double density,
+                                   double g_mu_line, REAL * mu_total, REAL * mu_absorber, REAL * factor, REAL * suppression)
+{
+    size_t num_e = energies.size();
+    size_t e = 0;
+
+    for (; e + KERNEL_WIDTH <= num_e; e += KERNEL_WIDTH)
+    {
+        fluorescence_points < REAL > (&mass_total[e], &mass_absorber[e], density, g_mu_line, KERNEL_WIDTH,
+                                      mu_total + e, mu_absorber + e, factor + e, suppression + e);
+    }
+
+    fluorescence_points < REAL > (mass_total.data() + e, mass_absorber.data() + e, density, g_mu_line, num_e - e,
+                                  mu_total + e, mu_absorber + e, factor + e, suppression + e);
+}
+
+int Fluorescence::run(const Sample & sample, string_view file_name)
+{
+    TraceSpan span("compute");
+
+    const vector < string > & elements = sample.get_elements();
+    const vector < float > & mass_percents = sample.get_mass_percents();
+    float density = sample.get_density();
+
+    int absorber_index = distance(elements.begin(), find(elements.begin(), elements.end(), absorber));
+
+    if (absorber_index == elements.size() || energies.size() == 0) return BAD_INPUT;
+
+    double retEnergy[9];
+    double xsec[11];
+    double fl_yield[4];
+    char err_msg[100];
+
+    //Emission line and yield of the absorber
+    backend->evaluate(absorber, 0, 0, retEnergy, xsec, fl_yield, err_msg);
+
+    double line_energy = (shell == 0) ? retEnergy[5] : retEnergy[7];
+    double yield = (shell == 0) ? fl_yield[0] : fl_yield[3];
+
+    if (line_energy <= 0) return BAD_INPUT;
+
+    //Attenuation of the emission line is the same for every point of the scan
+    CompensatedSum line_sum;
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        backend->evaluate(elements[i], line_energy, 0, retEnergy, xsec, fl_yield, err_msg);
+        line_sum.add(mass_percents[i] * xsec[3]);
+    }
+
+    double mu_line = line_sum.get() * density;
+
+    //Absorber and total mass attenuation at every incident energy
+    size_t num_e = energies.size();
+    vector < double > mass_absorber(num_e);
+    vector < double > mass_total(num_e);
+    vector < CompensatedSum > total_sums(num_e);
+
+    vector < double > element_mu(num_e);
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        backend->evaluate_mu(elements[i], energies.data(), element_mu.data(), num_e);
+
+        for (size_t e = 0; e < num_e; e++)
+        {
+            total_sums[e].add(mass_percents[i] * element_mu[e]);
+            if (i == absorber_index) mass_absorber[e] = mass_percents[i] * element_mu[e];
+        }
+    }
+
+    for (size_t e = 0; e < num_e; e++) mass_total[e] = total_sums[e].get();
+
+    //Self-absorption factor over the whole scan, kept in the kernel's precision
+    double g_mu_line = sin(incidence * PI / 180) / sin(exit * PI / 180) * mu_line;
+
+    ColumnBlock block;
+    const char * names[] = {"energy_kev", "mu_total_1_cm", "mu_absorber_1_cm", "amplitude_factor", "suppression"};
+    block.names.assign(names, names + 5);
+    block.columns.push_back(energies);
+    block.rows = num_e;
+
+    if (precision == PRECISION_FLOAT)
+    {
+        vector < vector < float > > & out = block.float_columns;
+        out.assign(4, vector < float > (num_e));
+        compute_factors(mass_total, mass_absorber, density, g_mu_line, out[0].data(), out[1].data(), out[2].data(), out[3].data());
+    }
+    else
+    {
+        vector < vector < double > > & out = block.columns;
+        out.resize(5, vector < double > (num_e));
+        compute_factors(mass_total, mass_absorber, density, g_mu_line, out[1].data(), out[2].data(), out[3].data(), out[4].data());
+    }
+
+    ofstream file(("samples/" + string(file_name) + ".csv").c_str());
+
+    if (!file) return BAD_INPUT;
+
+    file << "# absorber " << absorber << ", emission line " << line_energy << " keV, fluorescence yield " << yield
+         << ", mu at line " << mu_line << " 1/cm, incidence " << incidence << " deg, exit " << exit << " deg" << endl;
+
+    for (int col = 0; col < 5; col++) file << block.names[col] << (col < 4 ? ',' : '\n');
+
+    string text;
+    format_columns(block, 0, num_e, block.labels.size() > 0, &text);
+    file.write(text.data(), text.size());
+
+    file.close();
+
+    return NO_ERR;
+}
+
+//A uniform layer in the beam path, such as tape, a cell window or an air gap. The mass
+//attenuation over the last energy grid the layer was evaluated on is kept, so a layer
+//reused across samples and runs is only evaluated again when the grid or the cross
+//sections change.
+class Layer
+{
+    private:
+
+    string name;
+    string formula; //As given, or empty for a layer made from a sample
+    vector < string > elements;
+    vector < float > mass_percents;
+    float density; //g/cm^3
+    float thickness; //cm
+
+    vector < double > cached_energies;
+    vector < double > mass_mu; //Mass attenuation (cm^2/g) at each cached energy
+    unsigned revision; //cross_section_revision of mass_mu, 0 if none
+
+    public:
+
+    Layer(string_view layer_name);
+    int set_formula(string_view inp_formula);
+    int set_material(const Sample & sample); //Composition and density of a sample
+    int set_density(float inp_density);
+    int set_thickness(float inp_thickness);
+
+    const string & get_name() const;
+    string get_description() const;
+    float get_density() const;
+    float get_thickness() const;
+
+    int evaluate(const vector < double > & energies); //Fill the mass attenuation at each energy
+    const vector < double > & get_mass_mu() const; //From the last evaluate()
+};
+
+Layer::Layer(string_view layer_name) : name(layer_name)
+{
+    density = 0;
+    thickness = 0;
+    revision = 0;
+}
+
+int Layer::set_formula(string_view inp_formula)
+{
+    vector < string > inp_elements;
+    vector < float > inp_mass_percents;
+
+    if (parse_formula(string(inp_formula), &inp_elements, &inp_mass_percents) != NO_ERR) return BAD_INPUT;
+
+    formula = inp_formula;
+    elements = move(inp_elements);
+    mass_percents = move(inp_mass_percents);
+    revision = 0;
+
+    return NO_ERR;
+}
+
+int Layer::set_material(const Sample & sample)
+{
+    formula.clear();
+    elements = sample.get_elements();
+    mass_percents = sample.get_mass_percents();
+    density = sample.get_density();
+    revision = 0;
+
+    return NO_ERR;
+}
+
+int Layer::set_density(float inp_density)
+{
+    if (inp_density <= 0) return BAD_INPUT;
+
+    density = inp_density;
+    return NO_ERR;
+}
+
+int Layer::set_thickness(float inp_thickness)
+{
+    if (inp_thickness <= 0) return BAD_INPUT;
+
+    thickness = inp_thickness;
+    return NO_ERR;
+}
+
+const string & Layer::get_name() const
+{
+    return name;
+}
+
+float Layer::get_density() const
+{
+    return density;
+}
+
+float Layer::get_thickness() const
+{
+    return thickness;
+}
+
+string Layer::get_description() const
+{
+    ostringstream text;
+
+    text << (formula.size() ? formula : "sample") << ", " << density << " g/cm^3, " << thickness * 10000 << " microns";
+
+    return text.str();
+}
+
+int Layer::evaluate(const vector < double > & energies)
+{
+    if (revision == cross_section_revision && energies == cached_energies) return NO_ERR;
+
+    size_t num_e = energies.size();
+    vector < CompensatedSum > sums(num_e);
+    vector < double > element_mu(num_e);
+
+    for (int i = 0; i < elements.size(); i++)
+    {
+        int status = backend->evaluate_mu(elements[i], energies.data(), element_mu.data(), num_e);
+
+        if (status != no_error && status != within_edge) return BAD_INPUT;
+
+        for (size_t e = 0; e < num_e; e++) sums[e].add(mass_percents[i] * element_mu[e]);
+    }
+
+    cached_energies = energies;
+    mass_mu.resize(num_e);
+
+    for (size_t e = 0; e < num_e; e++) mass_mu[e] = sums[e].get();
+
+    revision = cross_section_revision;
+
+    return NO_ERR;
+}
+
+const vector < double > & Layer::get_mass_mu() const
+{
+    return mass_mu;
+}
+
+//Transmission through a stack of layers in beam order. At each energy the stack gives
+//the fraction of the beam transmitted through every layer and the fraction of the
+//incident beam absorbed in each one. The stack points at its layers, so the layers
+//keep their cached cross sections between stacks; they must outlive the run.
+class LayerStack
+{
+    private:
+
+    vector < Layer * > layers;
+    vector < double > energies; //Photon energies (keV)
+
+    public:
+
+    int add_layer(Layer * layer);
+    int set_energies(vector < double > inp_energies);
+
+    int compute(ColumnBlock * block); //Energy, transmission and absorbed fraction per layer
+    int run(string_view file_name); //Compute and write to file
+};
+
+int LayerStack::add_layer(Layer * layer)
+{
+    if (layer->get_density() <= 0 || layer->get_thickness() <= 0) return BAD_INPUT;
+
+    layers.push_back(layer);
+    return NO_ERR;
+}
+
+int LayerStack::set_energies(vector < double > inp_energies)
+{
+    energies = move(inp_energies);
+    return NO_ERR;
+}
+
+int LayerStack::compute(ColumnBlock * block)
+{
+    TraceSpan span("compute");
+
+    if (layers.size() == 0 || energies.size() == 0) return BAD_INPUT;
+
+    size_t num_e = energies.size();
+
+    block->names.assign(1, "energy_kev");
+    block->names.push_back("transmission");
+    block->columns.resize(2 + layers.size());
+    block->columns[0] = energies;
+    block->columns[1].assign(num_e, 1);
+    block->rows = num_e;
+
+    vector < double > & transmitted = block->columns[1];
+
+    for (int l = 0; l < layers.size(); l++)
+    {
+        if (layers[l]->evaluate(energies) != NO_ERR) return BAD_INPUT;
+
+        const vector < double > & mass_mu = layers[l]->get_mass_mu();
+        double mass_thickness = (double) layers[l]->get_density() * layers[l]->get_thickness(); //g/cm^2
+        vector < double > & absorbed = block->columns[2 + l];
+
+        absorbed.resize(num_e);
+
+        for (size_t e = 0; e < num_e; e++)
+        {
+            double layer_transmission = exp(-mass_mu[e] * mass_thickness);
+
+            absorbed[e] = transmitted[e] * (1 - layer_transmission);
+            transmitted[e] *= layer_transmission;
+        }
+
+        block->names.push_back(layers[l]->get_name() + "_absorbed");
+    }
+
+    return NO_ERR;
+}
+
+int LayerStack::run(string_view file_name)
+{
+    ColumnBlock block;
+
+    if (compute(&block) != NO_ERR) return BAD_INPUT;
+
+    ofstream file(("samples/" + string(file_name) + ".csv").c_str());
+
+    if (!file) return BAD_INPUT;
+
+    file << "# layers in beam order:";
+
+    for (int l = 0; l < layers.size(); l++) file << " " << layers[l]->get_name() << " (" << layers[l]->get_description() << ")";
+
+    file << endl;
+
+    for (int col = 0; col < block.names.size(); col++) file << block.names[col] << (col + 1 < block.names.size() ? ',' : '\n');
+
+    string text;
+    format_columns(block, 0, block.rows, block.labels.size() > 0, &text);
+    file.write(text.data(), text.size());
+
+    file.close();
+
+    return NO_ERR;
+}
+
+//Plans ion-chamber gas fills over a run schedule. At each photon energy the chamber is
+//filled at a fixed total pressure with two of He, N2, Ar and Kr, mixed so that it
+//absorbs a target fraction of the beam. Pairs are tried from the lightest up, as the
+//lighter gases are cheaper and vary less across a scan. Each gas is evaluated over
+//every energy of the schedule at once.
+class GasFill
+{
+    private:
+
+    float length; //Chamber length along the beam (cm)
+    float pressure; //Total fill pressure (atm)
+    float target; //Fraction of the beam to absorb
+    vector < double > energies; //Photon energies (keV)
+    vector < string > labels; //What each energy is for, e.g. "Fe K"
+    vector < Layer > gases; //Pure gases at the fill pressure over the chamber length
+
+    public:
+
+    GasFill();
+    int set_chamber(float inp_length, float inp_pressure);
+    int set_target(float fraction);
+    int add_energy(double energy, string_view label);
+    int add_edge(string_view edge_name); //e.g. Fe-K or Pb-L3
+    size_t get_num_energies();
+
+    int compute(ColumnBlock * block); //Partial pressure fraction of each gas and the absorption at each energy
+    int run(string_view file_name); //Compute and write the fill table to file
+};
+
+const int NUM_GASES = 4;
+const char * GAS_NAMES[NUM_GASES] = {"He", "N2", "Ar", "Kr"};
+const float GAS_DENSITIES[NUM_GASES] = {1.6535e-4, 1.1573e-3, 1.6503e-3, 3.4618e-3}; //g/cm^3 at 1 atm and 295 K
+
+//Mixtures in the order they are tried, as indices into GAS_NAMES
+const int NUM_MIXTURES = 5;
+const int GAS_MIXTURES[NUM_MIXTURES][2] = {{0, 1}, {1, 2}, {0, 2}, {2, 3}, {1, 3}};
+
+GasFill::GasFill()
+{
+    length = 30;
+    pressure = 1;
+    target = 0.1;
+
+    for (int g = 0; g < NUM_GASES; g++)
+    {
+        gases.push_back(Layer(GAS_NAMES[g]));
+        gases[g].set_formula(GAS_NAMES[g]);
+    }
+}
+
+int GasFill::set_chamber(float inp_length, float inp_pressure)
+{
+    if (inp_length <= 0 || inp_pressure <= 0) return BAD_INPUT;
+
+    length = inp_length;
+    pressure = inp_pressure;
+    return NO_ERR;
+}
+
+int GasFill::set_target(float fraction)
+{
+    if (fraction <= 0 || fraction >= 1) return BAD_INPUT;
+
+    target = fraction;
+    return NO_ERR;
+}
+
+int GasFill::add_energy(double energy, string_view label)
+{
+    if (energy <= 0) return BAD_INPUT;
+
+    energies.push_back(energy);
+    labels.push_back(string(label));
+    return NO_ERR;
+}
+
+int GasFill::add_edge(string_view edge_name)
+{
+    const char * edge_labels[5] = {"K", "L1", "L2", "L3", "M"};
+
+    size_t dash = edge_name.find('-');
+    string symbol(edge_name.substr(0, dash));
+    string_view shell = (dash == string_view::npos) ? "K" : edge_name.substr(dash + 1);
+
+    double retEnergy[9];
+    double xsec[11];
+    double fl_yield[4];
+    char err_msg[100];
+
+    if (backend->evaluate(symbol, 0, 0, retEnergy, xsec, fl_yield, err_msg) != no_error) return BAD_INPUT;
+
+    for (int j = 0; j < 5; j++)
+    {
+        if (shell == edge_labels[j]) return add_energy(retEnergy[j], symbol + " " + edge_labels[j]);
+    }
+
+    return BAD_INPUT;
+}
+
+size_t GasFill::get_num_energies()
+{
+    return energies.size();
+}
+
+int GasFill::compute(ColumnBlock * block)
+{
+    TraceSpan span("compute");
+
+    if (energies.size() == 0) return BAD_INPUT;
+
+    size_t num_e = energies.size();
+
+    //Linear absorption of each pure gas at every energy
+    vector < vector < double > > mu(NUM_GASES);
+
+    for (int g = 0; g < NUM_GASES; g++)
+    {
+        gases[g].set_density(GAS_DENSITIES[g] * pressure);
+        gases[g].set_thickness(length);
+
+        if (gases[g].evaluate(energies) != NO_ERR) return BAD_INPUT;
+
+        mu[g] = gases[g].get_mass_mu();
+        for (size_t e = 0; e < num_e; e++) mu[g][e] *= gases[g].get_density();
+    }
+
+    block->names.assign(1, "energy_kev");
+    for (int g = 0; g < NUM_GASES; g++) block->names.push_back(string(GAS_NAMES[g]) + "_fraction");
+    block->names.push_back("absorbed");
+
+    block->labels = labels;
+    block->columns.assign(NUM_GASES + 2, vector < double > (num_e, 0));
+    block->columns[0] = energies;
+    block->rows = num_e;
+
+    //The mixture absorbs 1 - exp(-L * (x mu_heavy + (1 - x) mu_light)), where x is the
+    //heavy gas share of the pressure, so x follows directly from the target
+    double needed = -log(1 - target) / length;
+
+    for (size_t e = 0; e < num_e; e++)
+    {
+        int light = 0, heavy = 0;
+        double x = 0;
+
+        if (needed <= mu[0][e])
+        {
+            x = 0; //Even pure He absorbs too much
+        }
+        else
+        {
+            for (int m = 0; m < NUM_MIXTURES; m++)
+            {
+                light = GAS_MIXTURES[m][0];
+                heavy = GAS_MIXTURES[m][1];
+                x = (needed - mu[light][e]) / (mu[heavy][e] - mu[light][e]);
+
+                if (x >= 0 && x <= 1) break;
+            }
+
+            x = min(1.0, max(0.0, x)); //Pure Kr if nothing reaches the target
+        }
+
+        block->columns[1 + light][e] += 1 - x;
+        block->columns[1 + heavy][e] += x;
+        block->columns[NUM_GASES + 1][e] = 1 - exp(-length * ((1 - x) * mu[light][e] + x * mu[heavy][e]));
+    }
+
+    return NO_ERR;
+}
+
+int GasFill::run(string_view file_name)
+{
+    ColumnBlock block;
+
+    if (compute(&block) != NO_ERR) return BAD_INPUT;
+
+    ofstream file(("samples/" + string(file_name) + ".csv").c_str());
+
+    if (!file) return BAD_INPUT;
+
+    file << "# chamber length " << length << " cm, total pressure " << pressure << " atm, target absorbed fraction "
+         << target << "; gas fractions are shares of the total pressure" << endl;
+
+    file << "edge,";
+
+    for (int col = 0; col < block.names.size(); col++) file << block.names[col] << (col + 1 < block.names.size() ? ',' : '\n');
+
+    string text;
+    format_columns(block, 0, block.rows, block.labels.size() > 0, &text);
+    file.write(text.data(), text.size());
+
+    file.close();
+
+    return NO_ERR;
+}
+
+//Layout of a cached curve file: header, the canonical key text padded to align doubles, then
+//'count' energies followed by the mu (1/cm), edge (keV) and step_mu (1/cm) at each of them
+struct CurveHeader
+{
+    char magic[8]; //"XSCURVE"
+    int32_t version;
+    int32_t key_size;
+    int64_t count;
+    int64_t data_offset; //Start of the energies: after the key, padded to align doubles
+};
+
+const int32_t CURVE_VERSION = 2; //Bump when the way samples are computed changes
+
+//Offset of the energies in a curve file with a key of the given size
+size_t curve_data_offset(size_t key_size)
+{
+    size_t end = sizeof(CurveHeader) + key_size;
+
+    return (end + alignof(double) - 1) / alignof(double) * alignof(double);
+}
+
+//A cached curve, mapped read-only until it is destroyed
+class CachedCurve
+{
+    private:
+
+    void * map;
+    size_t map_size;
+
+    public:
+
+    const double * mu;
+    const double * edge;
+    const double * step_mu;
+
+    CachedCurve(void * inp_map, size_t inp_map_size, size_t count);
+    ~CachedCurve();
+};
+
+CachedCurve::CachedCurve(void * inp_map, size_t inp_map_size, size_t count)
+{
+    map = inp_map;
+    map_size = inp_map_size;
+
+    const CurveHeader * header = (const CurveHeader *) map;
+    const double * energies = (const double *) ((const char *) map + header->data_offset);
+
+    mu = energies + count;
+    edge = mu + count;
+    step_mu = edge + count;
+}
+
+CachedCurve::~CachedCurve()
+{
+    munmap(map, map_size);
+}
+
+//Directory of computed absorption curves shared by every run and process. Files are
+//named by a hash of the canonical key (composition, density, backend version) and the
+//energy grid, and both are stored in the file and compared on lookup, so a change to
+//any input simply misses. Files are written under a private name and renamed into
+//place, which is atomic: readers see a complete file or none, and concurrent writers
+//of the same curve just replace each other's identical copies.
+class CurveCache
+{
+    private:
+
+    string directory; //Empty when caching is off
+
+    string file_name(const string & key, const vector < double > & energies);
+
+    public:
+
+    int set_directory(string inp_directory);
+    bool is_enabled();
+
+    string make_key(const Sample & sample);
+    shared_ptr < CachedCurve > lookup(const string & key, const vector < double > & energies);
+    int store(const string & key, const vector < double > & energies, const vector < double > & values);
+};
+
+int CurveCache::set_directory(string inp_directory)
+{
+    directory = inp_directory;
+
+    if (directory.size() == 0) return NO_ERR;
+
+    if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+        directory = "";
+        return BAD_INPUT;
+    }
+
+    return NO_ERR;
+}
+
+bool CurveCache::is_enabled()
+{
+    return directory.size() != 0;
+}
+
+//Elements sorted by symbol with their mass fractions, then density and backend.
+//Geometry is left out because the cached values do not depend on it.
+string CurveCache::make_key(const Sample & sample)
+{
+    const vector < string > & elements = sample.get_elements();
+    const vector < float > & mass_percents = sample.get_mass_percents();
+    vector < pair < string, float > > composition;
+
+    for (int i = 0; i < elements.size(); i++) composition.push_back(make_pair(elements[i], mass_percents[i]));
+
+    sort(composition.begin(), composition.end());
+
+    char number[32];
+    string key;
+
+    for (int i = 0; i < composition.size(); i++)
+    {
+        snprintf(number, sizeof(number), "%.9g", composition[i].second);
+        key += composition[i].first + ":" + number + ";";
+    }
+
+    snprintf(number, sizeof(number), "%.9g", sample.get_density());
+    key += string("rho=") + number + ";backend=" + backend->get_version();
+
+    return key;
+}
+
+string CurveCache::file_name(const string & key, const vector < double > & energies)
+{
+    uint64_t hash = fnv1a(key.data(), key.size());
+    hash = fnv1a((const char *) energies.data(), energies.size() * sizeof(double), hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.xscurve", (unsigned long long) hash);
+
+    return directory + name;
+}
+
+shared_ptr < CachedCurve > CurveCache::lookup(const string & key, const vector < double > & energies)
+{
+    if (!is_enabled()) return NULL;
+
+    int fd = ::open(file_name(key, energies).c_str(), O_RDONLY);
+
+    if (fd < 0) return NULL;
+
+    size_t count = energies.size();
+    size_t offset = curve_data_offset(key.size());
+    size_t expected = offset + 4 * count * sizeof(double);
+    struct stat info;
+
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size != expected)
+    {
+        ::close(fd);
+        return NULL;
+    }
+
+    void * map = mmap(NULL, expected, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED) return NULL;
+
+    //Guard against hash collisions: the key and grid must match exactly
+    const CurveHeader * header = (const CurveHeader *) map;
+    const char * stored_key = (const char *) (header + 1);
+
+    if (strncmp(header->magic, "XSCURVE", 8) != 0 || header->version != CURVE_VERSION ||
+        header->key_size != (int32_t) key.size() || header->count != (int64_t) count ||
+        header->data_offset != (int64_t) offset || memcmp(stored_key, key.data(), key.size()) != 0 ||
+        memcmp((const char *) map + offset, energies.data(), count * sizeof(double)) != 0)
+    {
+        munmap(map, expected);
+        return NULL;
+    }
+
+    return make_shared < CachedCurve > (map, expected, count);
+}
+
+//values holds mu, edge and step_mu for every energy, one after the other
+int CurveCache::store(const string & key, const vector < double > & energies, const vector < double > & values)
+{
+    if (!is_enabled() || values.size() != 3 * energies.size()) return BAD_INPUT;
+
+    static atomic < unsigned > counter(0);
+
+    string final_name = file_name(key, energies);
+    string temp_name = final_name + ".tmp." + to_string(getpid()) + "." + to_string(counter++);
+
+    CurveHeader header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, "XSCURVE");
+    header.version = CURVE_VERSION;
+    header.key_size = key.size();
+    header.count = energies.size();
+    header.data_offset = curve_data_offset(key.size());
+
+    const char padding[sizeof(double)] = {0};
+    ofstream file(temp_name.c_str(), ios::binary);
+
+    file.write((const char *) &header, sizeof(header));
+    file.write(key.data(), key.size());
+    file.write(padding, header.data_offset - sizeof(header) - key.size());
+    file.write((const char *) energies.data(), energies.size() * sizeof(double));
+    file.write((const char *) values.data(), values.size() * sizeof(double));
+    file.close();
+
+    if (!file || rename(temp_name.c_str(), final_name.c_str()) != 0)
+    {
+        unlink(temp_name.c_str());
+        return BAD_INPUT;
+    }
+
+    return NO_ERR;
+}
+
+//Samples read from a batch file, one per line:
+//    name formula density energies [dilution]
+//where energies are given as for a sweep axis. Scans are split into chunks that are
+//scheduled as separate tasks; results are written in input order.
+class Batch
+{
+    private:
+
+    struct Job
+    {
+        Sample sample;
+        vector < double > energies;
+        string error; //Why the line could not be used, empty if it is fine
+        size_t index; //Position among all jobs of the input
+        string key; //Curve cache key
+        shared_ptr < CachedCurve > cached; //Curve found in the cache
+        vector < double > curve; //Curve being computed for the cache or the caller
+        bool keep; //Keep the curve for get_result()
+
+        Job(Sample inp_sample, size_t inp_index) : sample(inp_sample), index(inp_index), keep(false) {}
+    };
+
+    //Per-worker buffers, reused by every task the worker runs for this batch
+    struct Scratch
+    {
+        Sample sample;
+        ColumnBlock block;
+
+        Scratch() : sample("") {}
+    };
+
+    vector < Job > jobs; //The first num_jobs are this window's; the rest are kept for reuse
+    size_t num_jobs;
+    vector < Scratch > scratch;
+    vector < string > tokens; //Reused by add_line()
+    vector < string > elements;
+    vector < float > mass_percents;
+    Geometry geometry;
+    int num_threads;
+    bool stealing;
+    size_t chunk_size; //Energies per scheduled task
+    size_t window; //Jobs held in memory at once when streaming
+    size_t next_block; //Output block number of the first task of the next compute()
+    size_t num_lines; //Jobs seen so far, including other shards' jobs
+    int shard; //This process handles jobs with index % num_shards == shard
+    int num_shards;
+    bool failed; //Set when any line could not be used
+    CurveCache * cache; //Where scan results are looked up and saved, if anywhere
+
+    int open(AsyncWriter & writer); //Write headers and start numbering blocks
+    int compute(AsyncWriter & writer); //Compute the jobs in memory and push their results
+
+    public:
+
+    Batch();
+    int add_line(const string & line); //Parse and queue one batch line
+    int add_sample(const Sample & sample, const vector < double > & energies); //Queue a set up sample
+    int set_geometry(const Geometry & inp_geometry);
+    int set_num_threads(int num);
+    int set_stealing(bool steal);
+    int set_window(size_t num_jobs);
+    int set_shard(int inp_shard, int inp_num_shards);
+    int set_cache(CurveCache * inp_cache);
+    size_t get_num_jobs();
+    int get_result(size_t job, size_t n, double * mu, double * edge, double * step_mu); //Of an added sample after run()
+
+    int run(AsyncWriter & writer); //Compute every job and write the results in order
+    int stream(istream & in, AsyncWriter & writer); //Read, compute and write with bounded memory
+};
+
+Batch::Batch() : geometry("die_13mm")
+{
+    num_threads = max(1u, thread::hardware_concurrency());
+    stealing = true;
+    chunk_size = 256;
+    window = 1024;
+    next_block = 0;
+    num_lines = 0;
+    shard = 0;
+    num_shards = 1;
+    failed = false;
+    cache = NULL;
+    num_jobs = 0;
+}
+
+int Batch::set_geometry(const Geometry & inp_geometry)
+{
+    geometry = inp_geometry;
+    return NO_ERR;
+}
+
+int Batch::set_num_threads(int num)
+{
+    num_threads = max(1, num);
+    return NO_ERR;
+}
+
+int Batch::set_stealing(bool steal)
+{
+    stealing = steal;
+    return NO_ERR;
+}
+
+int Batch::set_window(size_t num_jobs)
+{
+    window = max((size_t) 1, num_jobs);
+    return NO_ERR;
+}
+
+int Batch::set_shard(int inp_shard, int inp_num_shards)
+{
+    if (inp_num_shards < 1 || inp_shard < 0 || inp_shard >= inp_num_shards) return BAD_INPUT;
+
+    shard = inp_shard;
+    num_shards = inp_num_shards;
+    return NO_ERR;
+}
+
+int Batch::set_cache(CurveCache * inp_cache)
+{
+    cache = inp_cache;
+    return NO_ERR;
+}
+
+size_t Batch::get_num_jobs()
+{
+    return num_jobs;
+}
+
+int Batch::add_line(const string & line)
+{
+    tokens.clear();
+    string_explode(line, " \t", &tokens);
+
+    if (tokens.size() == 0 || tokens[0][0] == '#') return NO_ERR;
+
+    //Jobs of other shards are counted but not kept
+    size_t index = num_lines++;
+
+    if (index % num_shards != shard) return NO_ERR;
+
+    //Reuse a job left from an earlier window, keeping the capacity of its buffers
+    if (num_jobs == jobs.size()) jobs.push_back(Job(Sample(""), 0));
+
+    Job & job = jobs[num_jobs++];
+    job.sample.set_name(tokens[0]);
+    job.index = index;
+    job.error.clear();
+    job.key.clear();
+    job.cached.reset();
+    job.curve.clear();
+    job.energies.clear();
+    job.keep = false;
+    job.sample.set_quiet(true);
+
+    if (tokens.size() < 4 || tokens.size() > 5)
+    {
+        job.error = "expected: name formula density energies [dilution]";
+    }
+    else if (parse_formula(tokens[1], &elements, &mass_percents) != NO_ERR)
+    {
+        job.error = "bad formula or missing atomic weight";
+    }
+    else if (atof(tokens[2].c_str()) <= 0 || parse_energies(tokens[3], &job.energies) != NO_ERR)
+    {
+        job.error = "bad density or energies";
+    }
+    else
+    {
+        job.sample.set_num_elements(elements.size());
+        job.sample.set_elements(elements);
+        job.sample.set_mass_percents(mass_percents);
+        job.sample.set_density(atof(tokens[2].c_str()));
+        job.sample.set_geometry(geometry);
+
+        if (tokens.size() == 5 && atof(tokens[4].c_str()) > 0) job.sample.compute_dilution(atof(tokens[4].c_str()));
+    }
+
+    return job.error.size() ? BAD_INPUT : NO_ERR;
+}
+
+int Batch::add_sample(const Sample & sample, const vector < double > & energies)
+{
+    if (num_jobs == jobs.size()) jobs.push_back(Job(Sample(""), 0));
+
+    Job & job = jobs[num_jobs++];
+    job.sample = sample;
+    job.index = num_lines++;
+    job.error.clear();
+    job.key.clear();
+    job.cached.reset();
+    job.curve.clear();
+    job.energies = energies;
+    job.keep = true;
+    job.sample.set_quiet(true);
+
+    return NO_ERR;
+}
+
+int Batch::get_result(size_t job, size_t n, double * mu, double * edge, double * step_mu)
+{
+    if (job >= num_jobs || !jobs[job].keep || n >= jobs[job].energies.size()) return BAD_INPUT;
+
+    const Job & result = jobs[job];
+    size_t num_e = result.energies.size();
+
+    if (result.cached)
+    {
+        *mu = result.cached->mu[n];
+        *edge = result.cached->edge[n];
+        *step_mu = result.cached->step_mu[n];
+    }
+    else if (result.curve.size())
+    {
+        *mu = result.curve[n];
+        *edge = result.curve[num_e + n];
+        *step_mu = result.curve[2 * num_e + n];
+    }
+    else
+    {
+        return NO_DATA;
+    }
+
+    return NO_ERR;
+}
+
+int Batch::open(AsyncWriter & writer)
+{
+    const char * names[] = {"name", "energy_kev", "density_g_cm3", "mu_1_cm", "absorption_length_um",
+                            "edge_kev", "step_mu_1_cm", "thickness_um", "mass_g"};
+
+    next_block = 0;
+    num_lines = 0;
+    failed = false;
+
+    return writer.open(vector < string > (names, names + 9), true);
+}
+
+int Batch::compute(AsyncWriter & writer)
+{
+    TraceSpan span("compute");
+
+    //One task per chunk of each job's energies
+    vector < pair < size_t, size_t > > tasks;
+
+    for (size_t j = 0; j < num_jobs; j++)
+    {
+        size_t num_chunks = max((size_t) 1, (jobs[j].energies.size() + chunk_size - 1) / chunk_size);
+
+        for (size_t c = 0; c < num_chunks; c++) tasks.push_back(make_pair(j, c));
+
+        if (jobs[j].error.size()) failed = true;
+
+        //Use a cached curve if there is one, otherwise keep the results for the cache
+        if (jobs[j].error.size() == 0 && cache != NULL && cache->is_enabled())
+        {
+            jobs[j].key = cache->make_key(jobs[j].sample);
+            jobs[j].cached = cache->lookup(jobs[j].key, jobs[j].energies);
+
+            if (!jobs[j].cached) jobs[j].curve.assign(3 * jobs[j].energies.size(), 0);
+        }
+
+        if (jobs[j].error.size() == 0 && jobs[j].keep && !jobs[j].cached) jobs[j].curve.assign(3 * jobs[j].energies.size(), 0);
+    }
+
+    Scheduler scheduler(num_threads, stealing);
+    scratch.resize(num_threads);
+
+    scheduler.run(tasks.size(), [&](size_t id)
+    {
+        TraceSpan span("scan chunk");
+
+        Job & job = jobs[tasks[id].first];
+        size_t begin = tasks[id].second * chunk_size;
+        size_t end = min(job.energies.size(), begin + chunk_size);
+
+        Scratch & buffers = scratch[Scheduler::get_worker()];
+        ColumnBlock & block = buffers.block;
+        block.job = job.index;
+        block.comment.clear();
+
+        if (job.error.size())
+        {
+            block.comment = job.sample.get_name() + ": " + job.error;
+            block.rows = 0;
+            writer.push(next_block + id, block);
+            return;
+        }
+
+        Sample & sample = buffers.sample;
+        sample = job.sample;
+
+        //Energies too close to an edge are noted once per job, ahead of its first chunk
+        size_t num_near = (begin == 0) ? sample.count_near_edge(job.energies) : 0;
+
+        if (num_near)
+        {
+            block.comment = sample.get_name() + ": " + to_string(num_near) + (num_near == 1 ? " energy" : " energies")
+                          + " within 1 eV of an absorption edge, where the fits may be inaccurate";
+        }
+
+        block.rows = end - begin;
+        block.labels.resize(block.rows);
+        block.columns.resize(8);
+
+        for (int col = 0; col < 8; col++) block.columns[col].resize(block.rows);
+
+        size_t num_e = job.energies.size();
+        size_t num_unsized = 0;
+
+        for (size_t e = begin; e < end; e++)
+        {
+            sample.set_energy(job.energies[e]);
+
+            int err;
+
+            if (job.cached)
+            {
+                err = sample.compute_from(job.cached->mu[e], job.cached->edge[e], job.cached->step_mu[e]);
+            }
+            else
+            {
+                err = sample.compute();
+            }
+
+            if (err != NO_ERR) num_unsized++;
+
+            if (job.curve.size())
+            {
+                job.curve[e] = sample.get_mu();
+                job.curve[num_e + e] = sample.get_edge();
+                job.curve[2 * num_e + e] = sample.get_step_mu();
+            }
+
+            sample.write_row(&block, e - begin);
+        }
+
+        //Rows the geometry could not size (no edge in range for an edge step target)
+        if (num_unsized)
+        {
+            block.comment += (block.comment.size() ? "; " : sample.get_name() + ": ") + to_string(num_unsized)
+                           + (num_unsized == 1 ? " energy" : " energies")
+                           + " without an absorption edge in range to size the sample by, written with 0 thickness and mass";
+        }
+
+        writer.push(next_block + id, block);
+    });
+
+    next_block += tasks.size();
+
+    for (size_t j = 0; j < num_jobs; j++)
+    {
+        if (jobs[j].key.size() && jobs[j].curve.size()) cache->store(jobs[j].key, jobs[j].energies, jobs[j].curve);
+    }
+
+    return NO_ERR;
+}
+
+int Batch::run(AsyncWriter & writer)
+{
+    open(writer);
+    compute(writer);
+
+    int err = writer.close();
+
+    return (err == NO_ERR && !failed) ? NO_ERR : BAD_INPUT;
+}
+
+int Batch::stream(istream & in, AsyncWriter & writer)
+{
+    string line;
+
+    open(writer);
+
+    //Read, compute and write one window of jobs at a time, then drop them
+    while (in)
+    {
+        num_jobs = 0;
+
+        {
+            TraceSpan span("parse");
+
+            while (num_jobs < window && getline(in, line)) add_line(line);
+        }
+
+        compute(writer);
+    }
+
+    //Everything the batch allocated goes at once
+    jobs.clear();
+    scratch.clear();
+    num_jobs = 0;
+
+    int err = writer.close();
+
+    return (err == NO_ERR && !failed) ? NO_ERR : BAD_INPUT;
+}
+
+//Steady state: once buffers have grown, computing a point, a batch scan chunk or a
+//sweep chunk and dispatching a command line must not touch the heap. Prints the
+//allocations counted in each, with the time a million command lines take, and returns
+//BAD_INPUT if any of them allocated.
+int validate_allocations()
+{
+    CountAllocations counting;
+
+    Sample sample("hematite_diluted_in_BN"); //Longer than any short-string buffer
+    vector < string > elements;
+    vector < float > mass_percents;
+
+    parse_formula("Fe2O3", &elements, &mass_percents);
+    sample.set_quiet(true);
+    sample.set_num_elements(elements.size());
+    sample.set_elements(move(elements));
+    sample.set_mass_percents(move(mass_percents));
+    sample.set_density(5.24);
+    sample.compute_dilution(0.3);
+
+    Sample scratch("");
+    ColumnBlock block;
+    size_t counts[4];
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t allocations = allocation_count;
+
+        for (int i = 0; i < 10000; i++)
+        {
+            sample.set_energy(6.5 + i * 1e-4);
+            sample.compute();
+        }
+
+        counts[0] = allocation_count - allocations;
+        allocations = allocation_count;
+
+        for (int chunk = 0; chunk < 40; chunk++)
+        {
+            scratch = sample;
+            block.rows = 256;
+            block.labels.resize(block.rows);
+            block.columns.resize(8);
+
+            for (int col = 0; col < 8; col++) block.columns[col].resize(block.rows);
+
+            for (size_t e = 0; e < block.rows; e++)
+            {
+                scratch.set_energy(6.5 + (chunk * 256 + e) * 1e-4);
+                scratch.compute();
+                scratch.write_row(&block, e);
+            }
+        }
+
+        counts[1] = allocation_count - allocations;
+    }
+
+    Sweep sweep;
+    vector < double > values;
+
+    parse_axis("6:8:100", &values);
+    sweep.set_energies(values);
+    parse_axis("0:0.5:5", &values);
+    sweep.set_dilutions(values);
+    parse_axis("3:5.24:10", &values);
+    sweep.set_densities(values);
+    parse_axis("0.3:0.65:10", &values);
+    sweep.set_radii(values);
+    sweep.prepare(sample);
+
+    sweep.compute_chunk(0, &block);
+
+    size_t allocations = allocation_count;
+
+    for (size_t chunk = 0; chunk < sweep.get_num_chunks(); chunk++) sweep.compute_chunk(chunk, &block);
+
+    counts[2] = allocation_count - allocations;
+
+    //Command layer: a command file of a million lines through a table whose handlers
+    //only count the lines, so what is timed is tokenizing and dispatch
+    const char * command_names[] = {"list", "sample compute", "sample sweep", "geometry target", "backend fast", "trace"};
+    const char * command_lines[] = {"list", "sample compute", "sample sweep float", "geometry target die_13mm lengths 2.5",
+                                    "backend fast on", "\ttrace   off"};
+    const int num_command_lines = 1000000;
+
+    CommandTable table;
+    size_t num_dispatched = 0;
+
+    for (int c = 0; c < 6; c++)
+    {
+        table.add(command_names[c], command_names[c], "", [&num_dispatched](const vector < string_view > & args)
+        {
+            num_dispatched++;
+            return NO_ERR;
+        });
+    }
+
+    string command_file;
+
+    for (int i = 0; i < num_command_lines; i++)
+    {
+        command_file += command_lines[i % 6];
+        command_file += '\n';
+    }
+
+    double command_seconds = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        string_view rest = command_file;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        allocations = allocation_count;
+
+        while (rest.size())
+        {
+            size_t end = rest.find('\n');
+            if (end == string_view::npos) end = rest.size();
+
+            table.run(rest.substr(0, end));
+            rest.remove_prefix(min(end + 1, rest.size()));
+        }
+
+        counts[3] = allocation_count - allocations;
+        command_seconds = chrono::duration < double > (chrono::steady_clock::now() - start).count();
+    }
+
+    cout << "Command dispatch: " << num_command_lines << " lines in " << setprecision(3) << command_seconds << " s ("
+         << command_seconds / num_command_lines * 1e9 << " ns per line, " << num_dispatched / 2 << " handled)" << endl;
+
+    cout << "Steady-state allocations: " << counts[0] << " in 10000 sample computes, " << counts[1]
+         << " in 40 batch scan chunks, " << counts[2] << " in " << sweep.get_num_chunks() << " sweep chunks, "
+         << counts[3] << " in " << num_command_lines << " command lines" << endl;
+
+    if (counts[0] + counts[1] + counts[2] + counts[3] != 0)
+    {
+        cout << "Steady-state calls allocate!" << endl;
+        return BAD_INPUT;
+    }
+
+    return NO_ERR;
+}
+
+//Runs the batch engine on a synthetic mix of single points and long scans, once with
+//a static partition and once with work stealing, and compares the two outputs with the
+//chunk checksums --verify uses. With 'timed' set, also prints how long each run took
+//and how much it allocated. Returns BAD_INPUT if the outputs differ.
+int compare_schedulers(int num_threads, bool timed)
+{
+    vector < string > lines;
+
+    for (int i = 0; i < 2000; i++) lines.push_back("point Fe2O3 5.24 7.2");
+    for (int i = 0; i < 4; i++) lines.push_back("scan Fe2O3 5.24 6.9:8.0:5000");
+    lines.push_back("edges CuZnO 5.6 8.8:10.0:20000 0.3");
+    for (int i = 0; i < 2000; i++) lines.push_back("point NiO 6.67 8.4 0.5");
+
+    ChecksumSink * outputs[2];
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        CountAllocations counting;
+        Batch batch;
+        batch.set_num_threads(num_threads);
+        batch.set_stealing(mode == 1);
+
+        size_t parse_allocations = allocation_count;
+
+        for (int i = 0; i < lines.size(); i++) batch.add_line(lines[i]);
+
+        parse_allocations = allocation_count - parse_allocations;
+
+        CsvSink sink(NULL);
+        outputs[mode] = new ChecksumSink(&sink, false);
+        AsyncWriter writer(vector < OutputSink * > (1, outputs[mode]), 4 * num_threads);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        size_t run_allocations = allocation_count;
+
+        batch.run(writer);
+
+        double seconds = chrono::duration < double > (chrono::steady_clock::now() - start).count();
+        run_allocations = allocation_count - run_allocations;
+
+        if (timed)
+        {
+            cout << (mode == 0 ? "static partition: " : "work stealing:    ") << setprecision(4) << seconds << " s ("
+                 << num_threads << " threads), allocations: " << parse_allocations << " parsing "
+                 << lines.size() << " lines, " << run_allocations << " computing and formatting" << endl;
+        }
+    }
+
+    size_t diff;
+    bool same = outputs[0]->matches(*outputs[1], &diff);
+
+    if (same)
+    {
+        cout << "Static partition and work stealing output identical (" << outputs[0]->num_bytes << " bytes, "
+             << num_threads << " threads)" << endl;
+    }
+    else
+    {
+        cout << "Static partition and work stealing output differ from byte " << diff << "!" << endl;
+    }
+
+    delete outputs[0];
+    delete outputs[1];
+
+    return same ? NO_ERR : BAD_INPUT;
+}
+
+//Compares the fast-math cross sections with the libm reference for every element with
+//data, at points spread evenly in log(E) over the range of the fits. Returns BAD_INPUT
+//if the largest relative error is above max_error.
+int validate_fast_math(double max_error)
+{
+    const int num_points = 20000;
+    const double low = 1, high = 1000; //keV
+
+    vector < double > energies(num_points);
+
+    for (int n = 0; n < num_points; n++) energies[n] = low * pow(high / low, n / (num_points - 1.0));
+
+    double worst = 0;
+    double worst_energy = 0;
+    int worst_z = 0;
+    int num_elements = 0;
+    double reference_seconds = 0;
+    double fast_seconds = 0;
+    double xsec[4];
+
+    vector < double > reference(num_points);
+
+    for (int Z = 1; Z <= 94; Z++)
+    {
+        if (!mucal_has_data(Z)) continue;
+
+        num_elements++;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        for (int n = 0; n < num_points; n++)
+        {
+            mucal_eval < unit_cm2g, want_total > (Z, energies[n], NULL, xsec, NULL);
+            reference[n] = xsec[3];
+        }
+
+        chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+        double element_worst = 0;
+
+        for (int n = 0; n < num_points; n++)
+        {
+            mucal_eval < unit_cm2g, want_total | want_fast > (Z, energies[n], NULL, xsec, NULL);
+
+            double error = fabs(xsec[3] - reference[n]) / reference[n];
+
+            if (error > element_worst) element_worst = error;
+
+            if (error > worst)
+            {
+                worst = error;
+                worst_energy = energies[n];
+                worst_z = Z;
+            }
+        }
+
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+        reference_seconds += chrono::duration < double > (middle - start).count();
+        fast_seconds += chrono::duration < double > (end - middle).count();
+
+        if (element_worst > max_error) cout << "Z=" << Z << "  " << setprecision(3) << element_worst << endl;
+    }
+
+    cout << "Fast math against libm: " << num_elements << " elements, " << num_points << " energies from "
+         << setprecision(6) << low << " to " << high << " keV" << endl;
+    cout << "Largest relative error: " << setprecision(3) << worst << " (Z=" << worst_z << ", "
+         << setprecision(6) << worst_energy << " keV), bound " << setprecision(3) << max_error << endl;
+    cout << "Time per evaluation: libm " << setprecision(3) << reference_seconds / num_elements / num_points * 1e9
+         << " ns, fast " << fast_seconds / num_elements / num_points * 1e9 << " ns" << endl;
+
+    return (worst <= max_error) ? NO_ERR : BAD_INPUT;
+}
+
+//Runs the sweep kernel in float and in double over a grid of common samples and
+//reports how far the float results are from the double ones
+int validate_precision()
+{
+    const char * formulas[] = {"Fe2O3", "NiO", "PbTiO3", "CuSO4H10O5", "CeO2", "Au"};
+    const double sample_densities[] = {5.24, 6.67, 7.52, 2.29, 7.22, 19.3};
+    const char * names[] = {"mu", "absorption length", "pellet mass"};
+
+    double worst[3] = {0, 0, 0};
+    double seconds[2] = {0, 0};
+    size_t num_points = 0;
+
+    for (int f = 0; f < 6; f++)
+    {
+        vector < string > elements;
+        vector < float > mass_percents;
+
+        if (parse_formula(formulas[f], &elements, &mass_percents) != NO_ERR) return BAD_INPUT;
+
+        Sample sample(formulas[f]);
+        sample.set_num_elements(elements.size());
+        sample.set_elements(move(elements));
+        sample.set_mass_percents(move(mass_percents));
+        sample.set_density(sample_densities[f]);
+
+        vector < double > values;
+        Sweep sweep;
+
+        parse_axis("4:30:400", &values);
+        sweep.set_energies(values);
+        parse_axis("0:0.9:10", &values);
+        sweep.set_dilutions(values);
+        parse_axis(to_string(0.2 * sample_densities[f]) + ":" + to_string(sample_densities[f]) + ":10", &values);
+        sweep.set_densities(values);
+        parse_axis("0.2:1.0:10", &values);
+        sweep.set_radii(values);
+
+        if (sweep.prepare(sample) != NO_ERR) return BAD_INPUT;
+
+        num_points += sweep.get_num_points();
+
+        ColumnBlock blocks[2];
+
+        for (size_t chunk = 0; chunk < sweep.get_num_chunks(); chunk++)
+        {
+            for (int p = 0; p < 2; p++)
+            {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+                sweep.set_precision(p == 0 ? PRECISION_DOUBLE : PRECISION_FLOAT);
+                sweep.compute_chunk(chunk, &blocks[p]);
+
+                seconds[p] += chrono::duration < double > (chrono::steady_clock::now() - start).count();
+            }
+
+            for (int col = 4; col < 7; col++)
+            {
+                for (size_t row = 0; row < blocks[0].rows; row++)
+                {
+                    double reference = blocks[0].get(col, row);
+                    worst[col - 4] = max(worst[col - 4], fabs(blocks[1].get(col, row) - reference) / reference);
+                }
+            }
+        }
+    }
+
+    cout << "Float against double sweep kernel: " << num_points << " points" << endl;
+
+    for (int i = 0; i < 3; i++) cout << "Largest relative difference in " << names[i] << ": " << setprecision(3) << worst[i] << endl;
+
+    cout << "Time per point: double " << setprecision(3) << seconds[0] / num_points * 1e9
+         << " ns, float " << seconds[1] / num_points * 1e9 << " ns" << endl;
+
+    return NO_ERR;
+}
+
+//Samples
+vector < Sample > samples;
+
+//Undo and redo for commands that change the samples. Each step keeps copies of the
+//samples a command changed, from before and after it, and of the samples it added.
+//Copies share their composition with the live samples, so a step costs about the
+//size of the fields the command actually changed.
+class SampleHistory
+{
+    private:
+
+    struct Step
+    {
+        string command;
+        size_t num_before; //Samples there were before the command
+        vector < int > IDs; //Samples the command changed
+        vector < Sample > before; //Those samples before the command
+        vector < Sample > after; //After it, followed by the samples it added
+    };
+
+    vector < Step > undo_steps;
+    vector < Step > redo_steps;
+    Step pending;
+    size_t depth; //Steps kept for undo
+
+    public:
+
+    SampleHistory();
+    int begin(string_view command, const vector < int > & sample_IDs); //Before a command changes samples
+    int end(); //Once it is done
+    int undo();
+    int redo();
+    int write_screen();
+};
+
+SampleHistory::SampleHistory()
+{
+    depth = 100;
+}
+
+int SampleHistory::begin(string_view command, const vector < int > & sample_IDs)
+{
+    pending.command = command;
+    pending.num_before = samples.size();
+    pending.IDs = sample_IDs;
+    pending.before.clear();
+    pending.after.clear();
+
+    for (int i = 0; i < sample_IDs.size(); i++) pending.before.push_back(samples[sample_IDs[i]]);
+
+    return NO_ERR;
+}
+
+int SampleHistory::end()
+{
+    for (int i = 0; i < pending.IDs.size(); i++) pending.after.push_back(samples[pending.IDs[i]]);
+    for (size_t ID = pending.num_before; ID < samples.size(); ID++) pending.after.push_back(samples[ID]);
+
+    if (undo_steps.size() == depth) undo_steps.erase(undo_steps.begin());
+
+    undo_steps.push_back(move(pending));
+    redo_steps.clear();
+
+    return NO_ERR;
+}
+
+int SampleHistory::undo()
+{
+    if (undo_steps.size() == 0) return BAD_INPUT;
+
+    Step & step = undo_steps.back();
+
+    samples.erase(samples.begin() + step.num_before, samples.end());
+
+    for (int i = 0; i < step.IDs.size(); i++) samples[step.IDs[i]] = step.before[i];
+
+    cout << "Undid '" << step.command << "'." << endl;
+
+    redo_steps.push_back(move(step));
+    undo_steps.pop_back();
+
+    return NO_ERR;
+}
+
+int SampleHistory::redo()
+{
+    if (redo_steps.size() == 0) return BAD_INPUT;
+
+    Step & step = redo_steps.back();
+
+    for (int i = 0; i < step.IDs.size(); i++) samples[step.IDs[i]] = step.after[i];
+    for (size_t i = step.IDs.size(); i < step.after.size(); i++) samples.push_back(step.after[i]);
+
+    cout << "Redid '" << step.command << "'." << endl;
+
+    undo_steps.push_back(move(step));
+    redo_steps.pop_back();
+
+    return NO_ERR;
+}
+
+//Lists the steps that can be undone, oldest first, then those that can be redone
+int SampleHistory::write_screen()
+{
+    for (size_t i = 0; i < undo_steps.size(); i++)
+    {
+        cout << i + 1 << ". " << undo_steps[i].command << " (" << undo_steps[i].IDs.size() << " changed, "
+             << undo_steps[i].after.size() - undo_steps[i].IDs.size() << " added)" << endl;
+    }
+
+    if (undo_steps.size() == 0) cout << "Nothing to undo." << endl;
+
+    for (size_t i = redo_steps.size(); i > 0; i--)
+    {
+        cout << "   undone: " << redo_steps[i - 1].command << endl;
+    }
+
+    return NO_ERR;
+}
+
+SampleHistory history;
+
+//Sample holder geometries
+vector < Geometry > geometries(1, Geometry("die_13mm"));
+
+//Layers that can be put in a sample's beam path: 25 micron Kapton tape and a 10 cm air
+//path to start with, loaded by start_console()
+vector < Layer > default_layers()
+{
+    vector < Layer > defaults(2, Layer("kapton"));
+
+    defaults[0].set_formula("C22H10N2O5");
+    defaults[0].set_density(1.42);
+    defaults[0].set_thickness(25e-4);
+
+    defaults[1] = Layer("air");
+    defaults[1].set_formula("N1.562O0.42Ar0.0093");
+    defaults[1].set_density(0.001205);
+    defaults[1].set_thickness(10);
+
+    return defaults;
+}
+
+vector < Layer > layers;
+
+//Returns the index of a named layer, or -1 if there is none
+int find_layer(string_view layer_name)
+{
+    for (int i = 0; i < layers.size(); i++)
+    {
+        if (layers[i].get_name() == layer_name) return i;
+    }
+
+    return -1;
+}
+
+//Returns the index of a named geometry, or -1 if there is none
+int find_geometry(string_view geometry_name)
+{
+    for (int i = 0; i < geometries.size(); i++)
+    {
+        if (geometries[i].get_name() == geometry_name) return i;
+    }
+
+    return -1;
+}
+
+//Console commands and the table they are registered in
+CommandTable commands;
+
+//Reads a number from a command word, or 0 if it does not start with one
+double to_number(string_view word)
+{
+    double value = 0;
+    from_chars(word.data(), word.data() + word.size(), value);
+
+    return value;
+}
+
+//Prints the samples with their IDs. Returns NO_SAMPLES if there are none.
+int list_samples()
+{
+    //Make sure 'samples' isn't empty
+    if (samples.size() == 0)
+    {
+        cout << "No samples have been created yet." << endl;
+        return NO_SAMPLES;
+    }
+
+    cout << "List of samples:" << endl;
+
+    for (unsigned int i = 0; i < samples.size(); i++)
+    {
+        cout << i << ". " << samples[i].get_name() << endl;
+    }
+
+    return NO_ERR;
+}
+
+//Lists the samples and asks for one. Returns its ID, or NO_SAMPLES if there are none.
+int select_sample()
+{
+    if (list_samples() != NO_ERR) return NO_SAMPLES;
+
+    string user_input;
+    int sample_ID = NO_SAMPLES;
+
+    //Get the sample ID
+    do
+    {
+        cout << "Enter the ID of the sample you wish to select: ";
+        getline(cin, user_input);
+
+        if (isdigit(*user_input.c_str()))
+        {
+            sample_ID = atoi(user_input.c_str());
+        }
+
+    }while(!(sample_ID >= 0 && sample_ID < samples.size()));
+
+    return sample_ID;
+}
+
+//Matches a name against a pattern where '*' stands for any run of characters and '?'
+//for any one character
+bool match_glob(string_view pattern, string_view text)
+{
+    size_t p = 0, t = 0;
+    size_t star = string_view::npos, resume = 0;
+
+    while (t < text.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+        {
+            p++;
+            t++;
+        }
+        else if (p < pattern.size() && pattern[p] == '*')
+        {
+            star = p++;
+            resume = t;
+        }
+        else if (star != string_view::npos)
+        {
+            p = star + 1;
+            t = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') p++;
+
+    return p == pattern.size();
+}
+
+//Selects samples by a comma separated list of IDs, ID ranges (0-499), name patterns
+//(Fe*) or 'all'. The IDs are returned in ascending order without repeats. Returns
+//BAD_INPUT for an ID out of range or a target that matches nothing.
+int select_samples(string_view targets, vector < int > * sample_IDs)
+{
+    vector < string_view > items;
+    vector < bool > selected(samples.size(), false);
+
+    string_tokenize(targets, ",", &items);
+
+    if (items.size() == 0) return BAD_INPUT;
+
+    for (int i = 0; i < items.size(); i++)
+    {
+        string_view item = items[i];
+        int first = 0, last = 0;
+        bool found = false;
+
+        if (item == "all")
+        {
+            first = 0;
+            last = (int) samples.size() - 1;
+            found = samples.size() > 0;
+        }
+        else if (item.find_first_not_of("0123456789-") == string_view::npos)
+        {
+            const char * middle = item.data() + min(item.find('-'), item.size());
+            const char * end = item.data() + item.size();
+
+            from_chars_result parsed = from_chars(item.data(), middle, first);
+            bool valid = parsed.ec == errc() && parsed.ptr == middle;
+
+            last = first;
+
+            if (middle != end)
+            {
+                parsed = from_chars(middle + 1, end, last);
+                valid = valid && parsed.ec == errc() && parsed.ptr == end;
+            }
+
+            if (!valid || first > last || last >= (int) samples.size()) return BAD_INPUT;
+
+            found = true;
+        }
+
+        if (found)
+        {
+            for (int ID = first; ID <= last; ID++) selected[ID] = true;
+            continue;
+        }
+
+        for (int ID = 0; ID < samples.size(); ID++)
+        {
+            if (match_glob(item, samples[ID].get_name()))
+            {
+                selected[ID] = true;
+                found = true;
+            }
+        }
+
+        if (!found) return BAD_INPUT;
+    }
+
+    sample_IDs->clear();
+
+    for (int ID = 0; ID < samples.size(); ID++)
+    {
+        if (selected[ID]) sample_IDs->push_back(ID);
+    }
+
+    return NO_ERR;
+}
+
+//Runs a task for every selected sample on the batch scheduler, one sample per task.
+//The task gets the position of the sample in the list and its ID.
+int for_each_sample(const vector < int > & sample_IDs, const function < void (size_t, int) > & task)
+{
+    Scheduler scheduler(max(1u, thread::hardware_concurrency()), true);
+
+    return scheduler.run(sample_IDs.size(), [&](size_t i)
+    {
+        task(i, sample_IDs[i]);
+    });
+}
+
+//Picks the samples a command works on: those in the target list if one is given,
+//otherwise the one chosen at the ID prompt
+int get_targets(string_view targets, vector < int > * sample_IDs)
+{
+    if (targets.size() == 0)
+    {
+        int sample_ID = select_sample();
+
+        if (sample_ID == NO_SAMPLES) return NO_SAMPLES;
+
+        sample_IDs->assign(1, sample_ID);
+        return NO_ERR;
+    }
+
+    if (select_samples(targets, sample_IDs) != NO_ERR)
+    {
+        cout << "No samples match '" << targets << "'. Use IDs, ranges (0-4), names (Fe*) or all." << endl;
+        return BAD_INPUT;
+    }
+
+    return NO_ERR;
+}
+
+int command_quit(const vector < string_view > & args)
+{
+    return EXIT_CMD;
+}
+
+int command_help(const vector < string_view > & args)
+{
+    int err = commands.write_help();
+
+    cout << endl << "Targets are sample IDs, ranges (0-499), name patterns (Fe*) or all, separated by commas." << endl;
+
+    return err;
+}
+
+int command_list(const vector < string_view > & args)
+{
+    return list_samples();
+}
+
+//Create a new sample
+int command_sample_new(const vector < string_view > & args)
+{
+    //Check for one-word name
+    if (args.size() != 3)
+    {
+        cout << "A one-word sample name is required. Please re-input." << endl;
+        return NO_ERR;
+    }
+
+    history.begin("sample new", vector < int > ());
+    samples.push_back(Sample(args[2]));
+    history.end();
+
+    cout << "New sample created." << endl;
+
+    return NO_ERR;
+}
+
+//Rename a sample, or number a list of samples under one name
+int command_sample_rename(const vector < string_view > & args)
+{
+    if (args.size() > 4) return commands.bad_subcommand(args[0]);
+
+    vector < int > sample_IDs;
+    int err = get_targets(args.size() > 2 ? args[2] : string_view(), &sample_IDs);
+
+    if (err != NO_ERR) return err;
+
+    //Get the new name
+    string user_input;
+    vector < string > new_name;
+
+    if (args.size() == 4) new_name.push_back(string(args[3]));
+
+    while (new_name.size() != 1)
+    {
+        cout << "Enter the new (one-word) name for the sample: ";
+        getline(cin, user_input);
+
+        new_name.clear();
+        string_explode(user_input, " ", &new_name);
+    }
+
+    history.begin("sample rename", sample_IDs);
+
+    if (sample_IDs.size() == 1)
+    {
+        err = samples[sample_IDs[0]].set_name(new_name[0]);
+        history.end();
+
+        return err;
+    }
+
+    for (int i = 0; i < sample_IDs.size(); i++)
+    {
+        err = samples[sample_IDs[i]].set_name(new_name[0] + "_" + to_string(i));
+    }
+
+    history.end();
+
+    cout << sample_IDs.size() << " samples have been renamed." << endl;
+
+    return err;
+}
+
+//Compute quantities for a sample, or for every sample in a target list at once
+int command_sample_compute(const vector < string_view > & args)
+{
+    string_view targets;
+    float energy = 0;
+
+    for (int i = 2; i < args.size(); i++)
+    {
+        if (args[i] == "--energy" && i + 1 < args.size()) energy = to_number(args[++i]);
+        else if (targets.size() == 0) targets = args[i];
+        else return commands.bad_subcommand(args[0]);
+    }
+
+    vector < int > sample_IDs;
+    int err = get_targets(targets, &sample_IDs);
+
+    if (err != NO_ERR) return err;
+
+    string user_input;
+
+    //Get the energy
+    while (energy <= 0)
+    {
+        cout << "Enter the desired photon energy (in keV): ";
+        getline(cin, user_input);
+
+        if (isdigit(*user_input.c_str())) energy = atof(user_input.c_str());
+    }
+
+    history.begin("sample compute", sample_IDs);
+
+    if (targets.size() == 0)
+    {
+        samples[sample_IDs[0]].set_energy(energy);
+        err = samples[sample_IDs[0]].compute();
+        history.end();
+
+        if (err != NO_ERR) cout << "No absorption edge near " << energy << " keV to size the sample by its edge step." << endl;
+        else cout << "Computation successful." << endl;
+
+        return err;
+    }
+
+    //A target list runs as a batch with one job per sample, printed in list order
+    Batch batch;
+    vector < double > energies(1, energy);
+
+    for (int i = 0; i < sample_IDs.size(); i++)
+    {
+        samples[sample_IDs[i]].set_energy(energy);
+        batch.add_sample(samples[sample_IDs[i]], energies);
+    }
+
+    TextSink sink(&cout);
+    AsyncWriter writer(vector < OutputSink * > (1, &sink), 4 * max(1u, thread::hardware_concurrency()));
+
+    err = batch.run(writer);
+
+    for (int i = 0; i < sample_IDs.size(); i++)
+    {
+        double mu, edge, step_mu;
+
+        if (batch.get_result(i, 0, &mu, &edge, &step_mu) != NO_ERR || samples[sample_IDs[i]].compute_from(mu, edge, step_mu) != NO_ERR)
+        {
+            err = NO_DATA;
+        }
+    }
+
+    history.end();
+
+    cout << sample_IDs.size() << " samples have been computed." << endl;
+
+    return err;
+}
+
+//Compute sample dilution, for one sample or a target list. A lone argument is the
+//fraction for a prompted sample; a target list must be followed by the fraction.
+int command_sample_dilute(const vector < string_view > & args)
+{
+    if (args.size() > 4) return commands.bad_subcommand(args[0]);
+
+    //Check the fraction before prompting for a sample or changing the history
+    string_view fraction = args.size() > 2 ? args.back() : string_view();
+    double value = 0;
+    bool is_number = fraction.size() > 0 &&
+                     from_chars(fraction.data(), fraction.data() + fraction.size(), value).ptr == fraction.data() + fraction.size();
+
+    if (!is_number || value <= 0 || value >= 1)
+    {
+        cout << "Usage: sample dilute [targets] fraction, with a dilution fraction between 0 and 1." << endl;
+        return BAD_INPUT;
+    }
+
+    float dilution_percent = value;
+
+    vector < int > sample_IDs;
+    int err = get_targets(args.size() == 4 ? args[2] : string_view(), &sample_IDs);
+
+    if (err != NO_ERR) return err;
+
+    char percent_text[32];
+    snprintf(percent_text, sizeof(percent_text), "%g", dilution_percent);
+
+    //Make copies for dilution
+    vector < Sample > diluted_samples;
+
+    for (int i = 0; i < sample_IDs.size(); i++) diluted_samples.push_back(samples[sample_IDs[i]]);
+
+    for_each_sample(sample_IDs, [&](size_t i, int ID)
+    {
+        Sample & diluted_sample = diluted_samples[i];
+
+        diluted_sample.compute_dilution(dilution_percent);
+        diluted_sample.set_name(diluted_sample.get_name() + "_%_" + percent_text);
+    });
+
+    history.begin("sample dilute", vector < int > ());
+
+    for (int i = 0; i < diluted_samples.size(); i++) samples.push_back(move(diluted_samples[i]));
+
+    history.end();
+
+    if (diluted_samples.size() == 1)
+    {
+        cout << "Dilution successful." << endl;
+    }
+    else
+    {
+        cout << diluted_samples.size() << " diluted samples have been added." << endl;
+    }
+
+    return NO_ERR;
+}
+
+//Setup the sample
+int command_sample_setup(const vector < string_view > & args)
+{
+    int sample_ID = select_sample();
+
+    if (sample_ID == NO_SAMPLES) return NO_ERR;
+
+    string user_input;
+
+    history.begin("sample setup", vector < int > (1, sample_ID));
+
+    //Get the density
+    do
+    {
+        cout << "Enter the bulk density (in g/cm^3): ";
+        getline(cin, user_input);
+
+    }while(!isdigit(*user_input.c_str()));
+
+    samples[sample_ID].set_density(atof(user_input.c_str()));
+
+    //Get the elements
+    do
+    {
+        cout << "Enter the number of elements in the compound: ";
+        getline(cin, user_input);
+
+    }while(!isdigit(*user_input.c_str()));
+
+    samples[sample_ID].set_num_elements(atoi(user_input.c_str()));
+
+    vector < string > inp_elements;
+    vector < float > inp_mass_percents;
+
+    for (int i = 0; i < samples[sample_ID].get_num_elements(); i++)
+    {
+        cout << "Please enter the symbol for element #" << i+1 << ": ";
+        getline(cin, user_input);
+
+        inp_elements.push_back(user_input);
+
+        cout << "Please enter the mass percentage for element #" << i+1 << " (fraction between 0-1): ";
+        getline(cin, user_input);
+
+        inp_mass_percents.push_back(atof(user_input.c_str()));
+    }
+
+    int err = samples[sample_ID].set_elements(move(inp_elements));
+    err = samples[sample_ID].set_mass_percents(move(inp_mass_percents));
+
+    history.end();
+
+    cout << endl << "Sample has been successfully set up." << endl;
+
+    return err;
+}
+
+//Write sample info to screen, or the files of every sample in a target list
+int command_sample_write(const vector < string_view > & args)
+{
+    if (args.size() > 3) return commands.bad_subcommand(args[0]);
+
+    vector < int > sample_IDs;
+    int err = get_targets(args.size() == 3 ? args[2] : string_view(), &sample_IDs);
+
+    if (err != NO_ERR) return err;
+
+    if (sample_IDs.size() == 1)
+    {
+        int sample_ID = sample_IDs[0];
+
+        err = samples[sample_ID].write_screen();
+
+        err = samples[sample_ID].write_file(samples[sample_ID].get_name());
+
+        cout << "Sample has been saved to " << samples[sample_ID].get_name() << ".txt." << endl;
+
+        return err;
+    }
+
+    //Samples sharing a name append to the same file, so each file is written by one task
+    map < string_view, vector < int > > files;
+
+    for (int i = 0; i < sample_IDs.size(); i++) files[samples[sample_IDs[i]].get_name()].push_back(sample_IDs[i]);
+
+    vector < const vector < int > * > file_samples;
+
+    for (map < string_view, vector < int > >::const_iterator file = files.begin(); file != files.end(); file++)
+    {
+        file_samples.push_back(&file->second);
+    }
+
+    Scheduler scheduler(max(1u, thread::hardware_concurrency()), true);
+
+    scheduler.run(file_samples.size(), [&](size_t f)
+    {
+        for (int i = 0; i < file_samples[f]->size(); i++)
+        {
+            Sample & sample = samples[(*file_samples[f])[i]];
+            sample.write_file(sample.get_name());
+        }
+    });
+
+    cout << sample_IDs.size() << " samples have been saved to " << files.size() << " files in samples/." << endl;
+
+    return NO_ERR;
+}
+
+//Sweep a sample over several parameters at once
+int command_sample_sweep(const vector < string_view > & args)
+{
+    int sample_ID = select_sample();
+
+    if (sample_ID == NO_SAMPLES) return NO_ERR;
+
+    Sweep sweep;
+    vector < double > values;
+    string user_input;
+
+    if (args.size() > 2 && args[2] == "float") sweep.set_precision(PRECISION_FLOAT);
+
+    cout << "Axis values are single numbers or start:stop:count ranges." << endl;
+
+    do
+    {
+        cout << "Enter the photon energies (in keV): ";
+        getline(cin, user_input);
+
+    }while(parse_energies(user_input, &values) != NO_ERR);
+
+    sweep.set_energies(values);
+
+    do
+    {
+        cout << "Enter the BN dilution fractions (between 0-1): ";
+        getline(cin, user_input);
+
+    }while(parse_axis(user_input, &values) != NO_ERR);
+
+    sweep.set_dilutions(values);
+
+    do
+    {
+        cout << "Enter the bulk densities (in g/cm^3): ";
+        getline(cin, user_input);
+
+    }while(parse_axis(user_input, &values) != NO_ERR);
+
+    sweep.set_densities(values);
+
+    do
+    {
+        cout << "Enter the pellet radii (in cm): ";
+        getline(cin, user_input);
+
+    }while(parse_axis(user_input, &values) != NO_ERR);
+
+    sweep.set_radii(values);
+
+    string file_name = samples[sample_ID].get_name() + "_sweep";
+    int err = sweep.run(samples[sample_ID], file_name);
+
+    if (err == NO_ERR)
+    {
+        cout << sweep.get_num_points() << " points have been saved to " << file_name << ".csv." << endl;
+    }
+    else
+    {
+        cout << "Sweep failed -- make sure the sample has been set up." << endl;
+    }
+
+    return err;
+}
+
+//Choose the geometry a sample is sized for
+int command_sample_geometry(const vector < string_view > & args)
+{
+    int sample_ID = select_sample();
+
+    if (sample_ID == NO_SAMPLES) return NO_ERR;
+
+    string user_input;
+    int geometry_ID;
+
+    do
+    {
+        cout << "Enter the name of the geometry: ";
+        getline(cin, user_input);
+
+        geometry_ID = find_geometry(user_input);
+
+    }while(geometry_ID < 0);
+
+    history.begin("sample geometry", vector < int > (1, sample_ID));
+    int err = samples[sample_ID].set_geometry(geometries[geometry_ID]);
+    history.end();
+
+    cout << "Geometry has been set. Recompute the sample to update its masses." << endl;
+
+    return err;
+}
+
+//Estimate fluorescence self-absorption
+int command_sample_fluorescence(const vector < string_view > & args)
+{
+    int sample_ID = select_sample();
+
+    if (sample_ID == NO_SAMPLES) return NO_ERR;
+
+    Fluorescence fluorescence;
+    vector < double > values;
+    string symbol;
+    string user_input;
+
+    if (args.size() > 2 && args[2] == "float") fluorescence.set_precision(PRECISION_FLOAT);
+
+    cout << "Enter the symbol of the absorbing element: ";
+    getline(cin, symbol);
+
+    cout << "Enter the emission edge (K or L): ";
+    getline(cin, user_input);
+
+    fluorescence.set_absorber(symbol, user_input.size() ? user_input[0] : 'K');
+
+    do
+    {
+        cout << "Enter the incidence and exit angles (in degrees): ";
+        getline(cin, user_input);
+
+    }while(parse_axis(user_input, &values) != NO_ERR || values.size() != 2 ||
+           fluorescence.set_angles(values[0], values[1]) != NO_ERR);
+
+    do
+    {
+        cout << "Enter the incident photon energies (in keV): ";
+        getline(cin, user_input);
+
+    }while(parse_energies(user_input, &values) != NO_ERR);
+
+    fluorescence.set_energies(values);
+
+    string file_name = samples[sample_ID].get_name() + "_fluorescence";
+    int err = fluorescence.run(samples[sample_ID], file_name);
+
+    if (err == NO_ERR)
+    {
+        cout << "Self-absorption estimates have been saved to " << file_name << ".csv." << endl;
+    }
+    else
+    {
+        cout << "Calculation failed -- check the sample setup and absorbing element." << endl;
+    }
+
+    return err;
+}
+
+//Copy samples as variants that share their composition
+int command_sample_copy(const vector < string_view > & args)
+{
+    if (args.size() > 4) return commands.bad_subcommand(args[0]);
+
+    vector < int > sample_IDs;
+    int err = get_targets(args.size() > 2 ? args[2] : string_view(), &sample_IDs);
+
+    if (err != NO_ERR) return err;
+
+    history.begin("sample copy", vector < int > ());
+
+    for (int i = 0; i < sample_IDs.size(); i++)
+    {
+        Sample copy = samples[sample_IDs[i]];
+
+        if (args.size() < 4) copy.set_name(copy.get_name() + "_copy");
+        else if (sample_IDs.size() == 1) copy.set_name(args[3]);
+        else copy.set_name(string(args[3]) + "_" + to_string(i));
+
+        samples.push_back(move(copy));
+    }
+
+    history.end();
+
+    cout << sample_IDs.size() << (sample_IDs.size() == 1 ? " copy has" : " copies have") << " been added." << endl;
+
+    return NO_ERR;
+}
+
+//Change the bulk density of samples
+int command_sample_density(const vector < string_view > & args)
+{
+    if (args.size() > 4) return commands.bad_subcommand(args[0]);
+
+    vector < int > sample_IDs;
+    int err = get_targets(args.size() > 2 ? args[2] : string_view(), &sample_IDs);
+
+    if (err != NO_ERR) return err;
+
+    string user_input;
+    float density = (args.size() == 4) ? to_number(args[3]) : 0;
+
+    while (density <= 0)
+    {
+        cout << "Enter the bulk density (in g/cm^3): ";
+        getline(cin, user_input);
+
+        if (isdigit(*user_input.c_str())) density = atof(user_input.c_str());
+    }
+
+    history.begin("sample density", sample_IDs);
+
+    for (int i = 0; i < sample_IDs.size(); i++) samples[sample_IDs[i]].set_density(density);
+
+    history.end();
+
+    cout << "Density has been set. Recompute the samples to update their masses." << endl;
+
+    return NO_ERR;
+}
+
+//Undo or redo the last changes to the samples
+int command_undo(const vector < string_view > & args)
+{
+    int count = (args.size() > 1) ? max(1, (int) to_number(args[1])) : 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (history.undo() != NO_ERR)
+        {
+            cout << "Nothing left to undo." << endl;
+            break;
+        }
+    }
+
+    return NO_ERR;
+}
+
+int command_redo(const vector < string_view > & args)
+{
+    int count = (args.size() > 1) ? max(1, (int) to_number(args[1])) : 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (history.redo() != NO_ERR)
+        {
+            cout << "Nothing left to redo." << endl;
+            break;
+        }
+    }
+
+    return NO_ERR;
+}
+
+int command_history(const vector < string_view > & args)
+{
+    return history.write_screen();
+}
+
+//Transmission through the sample and the layers around it
+int command_sample_stack(const vector < string_view > & args)
+{
+    //Check the layer names before asking for anything
+    for (int i = 2; i < args.size(); i++)
+    {
+        if (args[i] != "sample" && find_layer(args[i]) < 0)
+        {
+            cout << "There is no layer named " << args[i] << ". See 'layer list'." << endl;
+            return BAD_INPUT;
+        }
+    }
+
+    int sample_ID = select_sample();
+
+    if (sample_ID == NO_SAMPLES) return NO_ERR;
+
+    if (samples[sample_ID].get_thickness() <= 0)
+    {
+        cout << "Compute the sample first, so its thickness is known." << endl;
+        return BAD_INPUT;
+    }
+
+    Layer sample_layer(samples[sample_ID].get_name());
+    sample_layer.set_material(samples[sample_ID]);
+    sample_layer.set_thickness(samples[sample_ID].get_thickness());
+
+    //Layers in beam order; the sample goes first unless its place is given
+    LayerStack stack;
+    bool placed = find(args.begin() + 2, args.end(), "sample") != args.end();
+    int num_layers = args.size() - 2;
+
+    if (!placed)
+    {
+        stack.add_layer(&sample_layer);
+        num_layers++;
+    }
+
+    for (int i = 2; i < args.size(); i++)
+    {
+        stack.add_layer(args[i] == "sample" ? &sample_layer : &layers[find_layer(args[i])]);
+    }
+
+    vector < double > values;
+    string user_input;
+
+    cout << "Axis values are single numbers or start:stop:count ranges." << endl;
+
+    do
+    {
+        cout << "Enter the photon energies (in keV): ";
+        getline(cin, user_input);
+
+    }while(parse_energies(user_input, &values) != NO_ERR);
+
+    stack.set_energies(values);
+
+    string file_name = samples[sample_ID].get_name() + "_stack";
+    int err = stack.run(file_name);
+
+    if (err == NO_ERR)
+    {
+        cout << "Transmission through " << num_layers << " layers has been saved to " << file_name << ".csv." << endl;
+    }
+    else
+    {
+        cout << "Calculation failed -- check the sample setup and layer compositions." << endl;
+    }
+
+    return err;
+}
+
+//List layers
+int command_layer_list(const vector < string_view > & args)
+{
+    for (int i = 0; i < layers.size(); i++)
+    {
+        cout << layers[i].get_name() << ": " << layers[i].get_description() << endl;
+    }
+
+    return NO_ERR;
+}
+
+//Create a new layer
+int command_layer_new(const vector < string_view > & args)
+{
+    if (args.size() != 6) return commands.bad_subcommand(args[0]);
+
+    Layer layer(args[2]);
+
+    if (find_layer(args[2]) >= 0 || args[2] == "sample" || layer.set_formula(args[3]) != NO_ERR ||
+        layer.set_density(to_number(args[4])) != NO_ERR || layer.set_thickness(to_number(args[5]) / 10000) != NO_ERR)
+    {
+        cout << "Bad or duplicate layer -- Please re-input." << endl;
+        return BAD_INPUT;
+    }
+
+    layers.push_back(layer);
+    cout << "New layer created." << endl;
+
+    return NO_ERR;
+}
+
+//Adds the energies of a run schedule to a gas fill plan: edges such as Fe-K or Pb-L3,
+//energies or start:stop:count ranges in keV, or 'samples' for the edge nearest the
+//energy of every computed sample
+int add_schedule(string_view schedule, GasFill * plan)
+{
+    vector < string_view > tokens;
+    vector < double > values;
+
+    string_tokenize(schedule, " ,", &tokens);
+
+    if (tokens.size() == 0) return BAD_INPUT;
+
+    for (int i = 0; i < tokens.size(); i++)
+    {
+        if (tokens[i] == "samples")
+        {
+            for (int ID = 0; ID < samples.size(); ID++)
+            {
+                if (samples[ID].get_edge() > 0) plan->add_energy(samples[ID].get_edge(), samples[ID].get_name());
+            }
+        }
+        else if (isdigit(tokens[i][0]))
+        {
+            if (parse_energies(string(tokens[i]), &values) != NO_ERR) return BAD_INPUT;
+
+            for (int v = 0; v < values.size(); v++)
+            {
+                if (plan->add_energy(values[v], "-") != NO_ERR) return BAD_INPUT;
+            }
+        }
+        else if (plan->add_edge(tokens[i]) != NO_ERR)
+        {
+            return BAD_INPUT;
+        }
+    }
+
+    return NO_ERR;
+}
+
+//Plan ion-chamber fills for a run schedule
+int command_gasfill(const vector < string_view > & args)
+{
+    if (args.size() != 4) return commands.bad_subcommand(args[0]);
+
+    GasFill plan;
+
+    if (plan.set_chamber(to_number(args[1]), to_number(args[2])) != NO_ERR || plan.set_target(to_number(args[3])) != NO_ERR)
+    {
+        cout << "Give the chamber length (cm), total pressure (atm) and an absorbed fraction between 0-1." << endl;
+        return BAD_INPUT;
+    }
+
+    string user_input;
+
+    do
+    {
+        plan = GasFill();
+        plan.set_chamber(to_number(args[1]), to_number(args[2]));
+        plan.set_target(to_number(args[3]));
+
+        cout << "Enter the edges (Fe-K, Pb-L3), energies in keV or 'samples': ";
+        getline(cin, user_input);
+
+    }while(add_schedule(user_input, &plan) != NO_ERR || plan.get_num_energies() == 0);
+
+    int err = plan.run("gasfill");
+
+    if (err == NO_ERR)
+    {
+        cout << "Fills for " << plan.get_num_energies() << " energies have been saved to gasfill.csv." << endl;
+    }
+    else
+    {
+        cout << "Calculation failed -- check the edges and energies." << endl;
+    }
+
+    return err;
+}
+
+//Compute masses for every sample and geometry
+int command_sample_masses(const vector < string_view > & args)
+{
+    int err = compute_masses(samples, geometries, "masses");
+
+    if (err == NO_ERR)
+    {
+        cout << "Masses have been saved to masses.csv." << endl;
+    }
+
+    return err;
+}
 
-    for (int i = 0; i < elements.size(); i++)
+//List geometries
+int command_geometry_list(const vector < string_view > & args)
+{
+    for (int i = 0; i < geometries.size(); i++)
     {
-        cout << setprecision(5) << masses[i] << "  " << elements[i] << endl;
+        cout << geometries[i].get_name() << ": " << geometries[i].get_description() << endl;
     }
 
-    cout << endl << "------------------------------------" << endl;
-    cout << endl;
-
     return NO_ERR;
 }
 
-int Sample::write_file(string file_name)
+//Create a new geometry
+int command_geometry_new(const vector < string_view > & args)
 {
-    ofstream file;
-
-    file_name = "samples/" + file_name + ".txt";
+    if (args.size() < 5) return commands.bad_subcommand(args[0]);
 
-    file.open(file_name.c_str(), fstream::app);
+    Geometry geometry((string(args[2])));
+    int err = NO_ERR;
 
-    file << endl << "------------------------------------" << endl << endl;
-    file << "Sample Name: " << name << endl << endl;
-    file << "Sample Composition:" << endl << endl;
+    if (args[3] == "disc")
+    {
+        err = geometry.set_disc(to_number(args[4]));
+    }
+    else if (args[3] == "rect" && args.size() == 6)
+    {
+        err = geometry.set_rectangle(to_number(args[4]), to_number(args[5]));
+    }
+    else if (args[3] == "film")
+    {
+        err = geometry.set_film(to_number(args[4]));
+    }
+    else
+    {
+        err = BAD_INPUT;
+    }
 
-    for (int i = 0; i < elements.size(); i++)
+    if (err == NO_ERR && find_geometry(args[2]) < 0)
     {
-        file << setprecision(5) << mass_percents[i] << "  " << elements[i] << endl;
+        geometries.push_back(geometry);
+        cout << "New geometry created." << endl;
+    }
+    else
+    {
+        cout << "Bad or duplicate geometry -- Please re-input." << endl;
+        err = BAD_INPUT;
     }
 
-    file << endl;
+    return err;
+}
 
-    file << "Photon Energy (keV): " << energy << endl;
-    file << "Absorption Coefficient (1/cm): " << mu << endl;
-    file << "Absorption Length (microns): " << absorption_length << endl << endl;
-    file << "Pellet Density (g/cm^3): " << density << endl;
-    file << "Pellet Radius (cm): " << radius << endl;
-    file << "Pellet Volume (cm^3): " << volume << endl;
-    file << "Pellet Mass (g): " << mass << endl;
-    file << endl << "Pellet Masses by Element (g): " << endl << endl;
+//Set the thickness target of a geometry
+int command_geometry_target(const vector < string_view > & args)
+{
+    if (args.size() != 5) return commands.bad_subcommand(args[0]);
 
-    for (int i = 0; i < elements.size(); i++)
+    int geometry_ID = find_geometry(args[2]);
+    float value = to_number(args[4]);
+    int err = BAD_INPUT;
+
+    if (geometry_ID >= 0 && args[3] == "lengths")
     {
-        file << setprecision(5) << masses[i] << "  " << elements[i] << endl;
+        err = geometries[geometry_ID].set_target(TARGET_LENGTHS, value);
+    }
+    else if (geometry_ID >= 0 && args[3] == "step")
+    {
+        err = geometries[geometry_ID].set_target(TARGET_STEP, value);
     }
 
-    file << endl << "------------------------------------" << endl;
-    file << endl;
+    if (err == NO_ERR)
+    {
+        cout << "Geometry target has been set." << endl;
+    }
+    else
+    {
+        cout << "Bad geometry target -- Please re-input." << endl;
+    }
 
-    file.close();
+    return err;
+}
+
+//Show the cross-section backend
+int command_backend(const vector < string_view > & args)
+{
+    if (args.size() != 1) return commands.bad_subcommand(args[0]);
+
+    cout << "Cross sections are computed by: " << backend->get_name() << endl;
+    cout << "Fast math: " << (mucal_fast_math(-1) ? "on" : "off") << endl;
 
     return NO_ERR;
 }
 
-int Sample::compute_dilution(float percent)
+int command_backend_fast(const vector < string_view > & args)
 {
-    int b_index;
-    int n_index;
+    if (args.size() != 3 || (args[2] != "on" && args[2] != "off")) return commands.bad_subcommand(args[0]);
 
-    //Search if B or N is already in sample and assign index appropriately
-    if (find(elements.begin(), elements.end(), "B") != elements.end())
+    mucal_fast_math(args[2] == "on");
+    cross_section_revision++;
+    cout << "Fast math: " << args[2] << endl;
+
+    return NO_ERR;
+}
+
+int command_backend_use(const vector < string_view > & args)
+{
+    if (args.size() != 3) return commands.bad_subcommand(args[0]);
+
+    int err = NO_ERR;
+
+    if (args[2] == "mcmaster")
     {
-        b_index = distance(elements.begin(), find(elements.begin(), elements.end(), "B"));
+        backend = &mcmaster_backend;
+        table_backend.close();
+    }
+    else if (args[2] == "interpolated")
+    {
+        backend = &interpolated_backend;
+        table_backend.close();
     }
     else
     {
-        elements.push_back("B");
-        mass_percents.push_back(0);
-        masses.push_back(0);
-        b_index = elements.size() - 1;
+        backend = &mcmaster_backend;
+        err = table_backend.open(string(args[2]));
+        if (err == NO_ERR) backend = &table_backend;
     }
 
-    if (find(elements.begin(), elements.end(), "N") != elements.end())
+    cross_section_revision++;
+
+    if (err == NO_ERR)
     {
-        n_index = distance(elements.begin(), find(elements.begin(), elements.end(), "N"));
+        cout << "Cross sections are computed by: " << backend->get_name() << endl;
     }
     else
     {
-        elements.push_back("N");
-        mass_percents.push_back(0);
-        masses.push_back(0);
-        n_index = elements.size() - 1;
+        cout << "Could not open a cross-section table from " << args[2] << "." << endl;
     }
 
-    //Reduce percents of all other elements
-    for (int i = 0; i < elements.size(); i++)
+    return err;
+}
+
+int command_backend_accuracy(const vector < string_view > & args)
+{
+    double worst = 0;
+
+    cout << "Interpolation error against mucal (checked at every interval midpoint):" << endl;
+
+    for (int Z = 1; Z <= 94; Z++)
     {
-        if (i != b_index && i != n_index)
-        {
-            mass_percents[i] *= 1 - percent;
-        }
-    }
+        double error = interpolated_backend.get_max_error(Z);
 
-    //set B and N mass percents
-    mass_percents[b_index] = 0.436*percent;
-    mass_percents[n_index] = 0.564*percent;
+        if (error > 0) cout << "Z=" << Z << "  " << setprecision(3) << error << endl;
+        worst = max(worst, error);
+    }
 
-    //adjust new total density
-    density = density*(1 - percent) + 2.29*percent;
+    cout << "Largest relative error: " << worst << " (tolerance " << interpolated_backend.get_tolerance() << ")" << endl;
 
     return NO_ERR;
 }
 
-int Sample::compute()
+int command_backend_export(const vector < string_view > & args)
 {
-    int err; //Used for mucal
-    int print_flag = 1;
-
-    float accumMu = 0; //accumulates sum part of mu value through multiplying
+    if (args.size() != 3) return commands.bad_subcommand(args[0]);
 
-    //Return variables for mucal
-    double retEnergy[9];
-    double xsec[11];
-    double fl_yield[4];
-    char err_msg[100];
-    char elemName[2];
+    int err = export_table(string(args[2]), 500);
 
-    for (int i = 0; i < elements.size();i++)
-    {
-        strcpy(elemName, elements[i].c_str());
-        err = mucal(elemName, 0, energy, 'c', print_flag, retEnergy, xsec, fl_yield, err_msg);
+    if (err == NO_ERR) cout << "McMaster fits have been tabulated to " << args[2] << "." << endl;
+    else cout << "Could not write " << args[2] << "." << endl;
 
-        accumMu += (mass_percents[i]*xsec[3]);
-    }
+    return err;
+}
 
-    //multiply in density
-    mu = accumMu * density;
+int command_backend_import(const vector < string_view > & args)
+{
+    if (args.size() != 4) return commands.bad_subcommand(args[0]);
 
-    absorption_length = (1 / mu) * 10000; //Absorption length in microns
+    int err = import_table(string(args[2]), string(args[3]));
 
-    radius = 0.65; //Radius in centimetres
+    if (err == NO_ERR) cout << "Table has been written to " << args[3] << "." << endl;
+    else cout << "Could not convert " << args[2] << "." << endl;
 
-    volume = 3.14 * radius * radius * (absorption_length / 10000); //Volume in cm^3
+    return err;
+}
 
-    mass = volume * density; //Total mass of pellet
+//Timeline tracing
+int command_trace(const vector < string_view > & args)
+{
+    if (args.size() != 2) return commands.bad_subcommand(args[0]);
 
-    for (int i = 0; i < elements.size(); i++)
+    if (args[1] == "off")
     {
-        masses[i] = mass_percents[i] * (volume * density); //Compute each mass needed to form pellet
+        int err = tracer.stop();
+        cout << (err == NO_ERR ? "Tracing stopped." : "Could not write the trace file.") << endl;
+
+        return err;
     }
 
+    tracer.start(string(args[1]));
+    cout << "Tracing to " << args[1] << " until 'trace off' or quit." << endl;
+
     return NO_ERR;
 }
 
-//Explodes a string
-void string_explode(string str, string separator, vector< string > * results){
-    size_t found;
+//Built-in console commands, in the order help lists them
+struct BuiltinCommand
+{
+    const char * command;
+    const char * usage;
+    const char * help; //Empty to leave out of help
+    int (* handler)(const vector < string_view > &);
+};
 
-    found = str.find_first_of(separator);
+const BuiltinCommand builtin_commands[] =
+{
+    {"help", "help", "", command_help},
+    {"list", "list", "List all samples", command_list},
+    {"sample new", "sample new [name]", "Creates a new sample", command_sample_new},
+    {"sample rename", "sample rename [targets] [name]", "Renames samples, numbering a list of them", command_sample_rename},
+    {"sample setup", "sample setup", "Setup sample properties", command_sample_setup},
+    {"sample compute", "sample compute [targets] [--energy E]", "Compute xray data for samples", command_sample_compute},
+    {"sample write", "sample write [targets]", "Write sample data to screen and file", command_sample_write},
+    {"sample dilute", "sample dilute [targets] fraction", "Compute BN dilution for samples", command_sample_dilute},
+    {"sample sweep", "sample sweep [float]", "Sweep energy, dilution, density and radius", command_sample_sweep},
+    {"sample geometry", "sample geometry", "Choose the holder geometry for a sample", command_sample_geometry},
+    {"sample copy", "sample copy [targets] [name]", "Add variants of samples that share their composition", command_sample_copy},
+    {"sample density", "sample density [targets] [g/cm^3]", "Change the bulk density of samples", command_sample_density},
+    {"sample masses", "sample masses", "Compute masses of all samples for all geometries", command_sample_masses},
+    {"sample fluorescence", "sample fluorescence [float]", "Estimate fluorescence self-absorption over a scan", command_sample_fluorescence},
+    {"sample stack", "sample stack [layers]", "Transmission through the sample and layers, e.g. kapton sample kapton air", command_sample_stack},
+    {"layer list", "layer list", "List all layers", command_layer_list},
+    {"layer new", "layer new [name] [formula] [density] [microns]", "Creates a new layer (g/cm^3)", command_layer_new},
+    {"geometry list", "geometry list", "List all geometries", command_geometry_list},
+    {"geometry new", "geometry new [name] disc [r] | rect [w] [h] | film [area]", "Creates a new geometry (cm, cm^2)", command_geometry_new},
+    {"geometry target", "geometry target [name] lengths [n] | step [s]", "Size a geometry for absorption lengths or edge step", command_geometry_target},
+    {"backend", "backend", "Show the cross-section backend in use", command_backend},
+    {"backend use", "backend use mcmaster | interpolated | [file]", "Use the McMaster fits, precomputed tables or a file", command_backend_use},
+    {"backend accuracy", "backend accuracy", "Report precomputed table error against the fits", command_backend_accuracy},
+    {"backend fast", "backend fast on | off", "Evaluate the fits with polynomial log/exp", command_backend_fast},
+    {"backend export", "backend export [file]", "Tabulate the McMaster fits to a file", command_backend_export},
+    {"backend import", "backend import [text] [file]", "Convert 'Z energy mu' text rows to a table file", command_backend_import},
+    {"gasfill", "gasfill [length] [atm] [fraction]", "Plan He/N2/Ar/Kr ion-chamber fills absorbing a fraction at each edge", command_gasfill},
+    {"undo", "undo [n]", "Undo the last n changes to samples", command_undo},
+    {"redo", "redo [n]", "Redo the last n undone changes", command_redo},
+    {"history", "history", "List the changes that can be undone", command_history},
+    {"trace", "trace [file] | off", "Record a timeline of runs to a trace-event JSON file", command_trace},
+    {"quit", "quit", "Quit program", command_quit}
+};
 
-    while(found != string::npos){
-        if(found > 0){
-            results->push_back(str.substr(0,found));
-        }
+//Adds the built-in console commands to the table
+int register_commands()
+{
+    int err = NO_ERR;
 
-        str = str.substr(found+1);
+    for (size_t i = 0; i < sizeof(builtin_commands) / sizeof(builtin_commands[0]); i++)
+    {
+        const BuiltinCommand & builtin = builtin_commands[i];
 
-        found = str.find_first_of(separator);
+        if (commands.add(builtin.command, builtin.usage, builtin.help, builtin.handler) != NO_ERR) err = BAD_INPUT;
     }
-    if(str.length() > 0){
-        results->push_back(str);
-    }
-}
 
-//Samples
-vector < Sample > samples;
+    return err;
+}
 
-int parse_input(string mode = "none")
+//Sets up what only the console needs, the command table and the default layers. The
+//one-shot modes never call it, so they start without parsing any of it.
+int start_console()
 {
-    int err = NO_ERR;
+    layers = default_layers();
+
+    return register_commands();
+}
 
+//Reads one command line from the console and runs it. Returns EXIT_CMD on quit or at
+//the end of the input.
+int parse_input()
+{
     string user_input;
-    vector < string > filtered_input;
 
-    if (mode == "none")
-    {
-        cout << "Please enter a command:" << endl;
-        cout << ">>";
-        getline(cin, user_input);
-        cout << endl;
+    cout << "Please enter a command:" << endl;
+    cout << ">>";
 
-        string_explode(user_input, " ", &filtered_input); //Explode the string by each word
-    }
-    else if (mode == "list")
-    {
-        filtered_input.resize(2);
-        filtered_input[0] = "list";
-        filtered_input[1] = "ID";
-    }
+    if (!getline(cin, user_input)) return EXIT_CMD;
 
-    //Quit Program
-    if (filtered_input[0] == "quit")
-    {
-        err = EXIT_CMD;
-    }
-    //Help menu
-    else if (filtered_input[0] == "help")
-    {
-        //Display all commands
-        cout << "List of available commands:" << endl << endl;
-        cout << "list                  ---List all samples" << endl;
-        cout << "sample new [name]     ---Creates a new sample" << endl;
-        cout << "sample rename         ---Renames a sample" << endl;
-        cout << "sample setup          ---Setup sample properties" << endl;
-        cout << "sample compute        ---Compute xray data for sample" << endl;
-        cout << "sample write          ---Write sample data to screen and file" << endl;
-        cout << "sample dilute         ---Compute BN dilution for sample" << endl;
-        cout << "quit                  ---Quit program" << endl;
+    cout << endl;
 
-    }
-    //Sample commands
-    else if (filtered_input[0] == "sample")
+    int err = commands.run(user_input);
+
+    cout << endl;
+    return err;
+}
+
+//Exit codes of the one-shot command line mode
+const int EXIT_OK = 0;
+const int EXIT_USAGE = 1; //Bad or missing arguments
+const int EXIT_DATA = 2; //No cross-section data for the sample
+const int EXIT_MERGE = 3; //Shards missing, mismatched or failing their checksum
+const int EXIT_MISMATCH = 4; //Serial and parallel runs disagree under --verify, or the schedulers do under --validate or --bench
+const int EXIT_ACCURACY = 5; //Fast math is outside the error bound under --validate
+const int EXIT_ALLOCATES = 6; //--validate or --bench found heap allocations in a steady-state call
+
+//Computes one sample from command line arguments, prints the results and returns an
+//exit code. Used instead of the interactive prompt whenever arguments are given.
+int run_command_line(int argc, char * argv[])
+{
+    string formula;
+    string command_file;
+    string batch_file;
+    string output_file;
+    string format = "csv";
+    int num_threads = max(1u, thread::hardware_concurrency());
+    bool stealing = true;
+    bool benchmark = false;
+    bool verify = false;
+    bool validate = false;
+    double max_error = 1e-6;
+    size_t window = 1024;
+    int shard = 0;
+    int num_shards = 1;
+    CurveCache cache;
+    float density = 0;
+    float energy = 0;
+    float dilution = 0;
+    bool json = false;
+    Geometry geometry("die_13mm");
+
+    for (int i = 1; i < argc; i++)
     {
-        if (filtered_input.size() == 1) filtered_input.push_back(" ");
+        string option = argv[i];
+        bool has_value = i + 1 < argc;
 
-        //Create a new sample
-        if (filtered_input[1] == "new")
+        if (option == "--json") json = true;
+        else if (option == "--static") stealing = false;
+        else if (option == "--bench") benchmark = true;
+        else if (option == "--verify") verify = true;
+        else if (option == "--trace" && has_value) tracer.start(argv[++i]);
+        else if (option == "--validate") validate = true;
+        else if (option == "--max-error" && has_value) max_error = atof(argv[++i]);
+        else if (option == "--fast-math") mucal_fast_math(1);
+        else if (option == "--commands" && has_value) command_file = argv[++i];
+        else if (option == "--batch" && has_value) batch_file = argv[++i];
+        else if (option == "--output" && has_value) output_file = argv[++i];
+        else if (option == "--format" && has_value) format = argv[++i];
+        else if (option == "--threads" && has_value) num_threads = atoi(argv[++i]);
+        else if (option == "--window" && has_value) window = atol(argv[++i]);
+        else if (option == "--cache" && has_value)
         {
-            //Check for one-word name
-            if (filtered_input.size() == 3)
+            if (cache.set_directory(argv[++i]) != NO_ERR)
             {
-                samples.push_back(Sample(filtered_input[2]));
-                cout << "New sample created." << endl;
+                cerr << "Could not use cache directory " << argv[i] << endl;
+                return EXIT_USAGE;
             }
-            else
+        }
+        else if (option == "--shard" && has_value)
+        {
+            if (sscanf(argv[++i], "%d/%d", &shard, &num_shards) != 2 || num_shards < 1 || shard < 0 || shard >= num_shards)
             {
-                cout << "A one-word sample name is required. Please re-input." << endl;
+                cerr << "Shards are given as i/N with 0 <= i < N" << endl;
+                return EXIT_USAGE;
             }
         }
-        //Rename a sample
-        else if (filtered_input[1] == "rename")
+        else if (option == "--merge" && i + 2 < argc)
         {
-            int sample_ID = parse_input("list");
-
-            if (sample_ID != NO_SAMPLES)
-            {
-                //Get the new name
-                vector < string > new_name;
-                do
-                {
-                    cout << "Enter the new (one-word) name for the sample: ";
-                    getline(cin, user_input);
+            vector < string > shard_files(argv + i + 2, argv + argc);
 
-                    string_explode(user_input, " ", &new_name);
-
-                }while(!new_name.size() == 1);
-
-                sample_ID = atoi(user_input.c_str());
+            return (merge_shards(argv[i + 1], shard_files) == NO_ERR) ? EXIT_OK : EXIT_MERGE;
+        }
+        else if (option == "--formula" && has_value) formula = argv[++i];
+        else if (option == "--density" && has_value) density = atof(argv[++i]);
+        else if (option == "--energy" && has_value) energy = atof(argv[++i]);
+        else if (option == "--dilute" && has_value) dilution = atof(argv[++i]);
+        else if (option == "--radius" && has_value) geometry.set_disc(atof(argv[++i]));
+        else if (option == "--lengths" && has_value) geometry.set_target(TARGET_LENGTHS, atof(argv[++i]));
+        else if (option == "--step" && has_value) geometry.set_target(TARGET_STEP, atof(argv[++i]));
+        else if (option == "--backend" && has_value)
+        {
+            string name = argv[++i];
 
-                err = samples[sample_ID].set_name(new_name[0]);
-            }
+            if (name == "interpolated") backend = &interpolated_backend;
+            else if (name != "mcmaster" && table_backend.open(name) == NO_ERR) backend = &table_backend;
+            else if (name != "mcmaster") return EXIT_DATA;
         }
-        //Compute quantities for a sample
-        else if (filtered_input[1] == "compute")
+        else
         {
-            //Show samples
-            int sample_ID = parse_input("list");
+            cerr << "Unknown option or missing value: " << option << endl;
+            return EXIT_USAGE;
+        }
+    }
 
-            if (sample_ID != NO_SAMPLES)
-            {
-                //Get the energy
-                do
-                {
-                    cout << "Enter the desired photon energy (in keV): ";
-                    getline(cin, user_input);
+    if (benchmark)
+    {
+        if (compare_schedulers(num_threads, true) != NO_ERR) return EXIT_MISMATCH;
 
-                }while(!isdigit(*user_input.c_str()));
+        return (validate_allocations() == NO_ERR) ? EXIT_OK : EXIT_ALLOCATES;
+    }
 
-                err = samples[sample_ID].set_energy(atof(user_input.c_str()));
+    if (validate)
+    {
+        int err = validate_fast_math(max_error);
+        validate_precision();
 
-                err = samples[sample_ID].compute();
+        if (err != NO_ERR) return EXIT_ACCURACY;
+        if (compare_schedulers(num_threads, false) != NO_ERR) return EXIT_MISMATCH;
 
-                cout << "Computation successful." << endl;
-            }
+        return (validate_allocations() == NO_ERR) ? EXIT_OK : EXIT_ALLOCATES;
+    }
 
-        }
-        //Compute sample dilution
-        else if (filtered_input[1] == "dilute")
+    //Console commands from a file, with any prompts they raise answered by the lines
+    //that follow them
+    if (command_file.size())
+    {
+        ifstream input(command_file.c_str());
+
+        if (!input)
         {
-             //Show samples
-            int sample_ID = parse_input("list");
+            cerr << "Could not read " << command_file << endl;
+            return EXIT_USAGE;
+        }
 
-            if (sample_ID != NO_SAMPLES)
-            {
-                //Make a copy for dilution
-                Sample diluted_sample = samples[sample_ID];
+        start_console();
 
-                if (filtered_input.size() > 2)
-                {
-                    float dilution_percent = atof(filtered_input[2].c_str());
+        streambuf * console = cin.rdbuf(input.rdbuf());
 
-                    diluted_sample.compute_dilution(dilution_percent);
+        while (parse_input() != EXIT_CMD);
 
-                    stringstream new_name;
-                    new_name << diluted_sample.get_name() << "_%_" << dilution_percent;
+        cin.rdbuf(console);
 
-                    diluted_sample.set_name(new_name.str());
+        return EXIT_OK;
+    }
 
-                    samples.push_back(diluted_sample);
+    if (batch_file.size())
+    {
+        ifstream input;
+        if (batch_file != "-") input.open(batch_file.c_str());
 
-                    cout << "Dilution successful." << endl;
-                }
-                else
-                {
-                    cout << "Enter a dilution percentage between 0-1." << endl;
-                }
-            }
+        if (batch_file != "-" && !input)
+        {
+            cerr << "Could not read " << batch_file << endl;
+            return EXIT_USAGE;
         }
-        //Setup the sample
-        else if (filtered_input[1] == "setup")
+
+        ofstream file;
+        if (output_file.size()) file.open(output_file.c_str(), ios::binary);
+
+        ostream & destination = output_file.size() ? (ostream &) file : cout;
+        istream & source = (batch_file == "-") ? cin : (istream &) input;
+
+        OutputSink * check = make_sink(format, &destination);
+        delete check;
+
+        if (check == NULL || (output_file.size() && !file))
         {
-            //Show samples
-            int sample_ID = parse_input("list");
+            cerr << "Bad output format or file" << endl;
+            return EXIT_USAGE;
+        }
 
-            if (sample_ID != NO_SAMPLES)
-            {
-                //Get the density
-                do
-                {
-                    cout << "Enter the bulk density (in g/cm^3): ";
-                    getline(cin, user_input);
+        //Runs the batch once with the given scheduler settings. Given a checksum
+        //sink, the output goes through it and is only stored if 'store' is set.
+        auto run_batch = [&](istream & in, ostream & out, int threads, bool steal, ChecksumSink ** checksums, bool store)
+        {
+            Batch batch;
+            batch.set_geometry(geometry);
+            batch.set_num_threads(threads);
+            batch.set_stealing(steal);
+            batch.set_window(window);
+            batch.set_shard(shard, num_shards);
 
-                }while(!isdigit(*user_input.c_str()));
+            //Runs being compared must both compute every curve rather than read them back
+            batch.set_cache(checksums ? NULL : &cache);
 
-                samples[sample_ID].set_density(atof(user_input.c_str()));
+            //Shards are always written in the mergeable format
+            OutputSink * sink = (num_shards > 1) ? new ShardSink(&out, shard, num_shards) : make_sink(format, &out);
+            OutputSink * first = sink;
 
-                //Get the elements
-                do
-                {
-                    cout << "Enter the number of elements in the compound: ";
-                    getline(cin, user_input);
+            if (checksums) first = *checksums = new ChecksumSink(sink, store);
 
-                }while(!isdigit(*user_input.c_str()));
+            AsyncWriter writer(vector < OutputSink * > (1, first), 4 * threads);
+            int err = batch.stream(in, writer);
+            writer.close();
 
-                samples[sample_ID].set_num_elements(atoi(user_input.c_str()));
+            delete sink;
 
-                vector < string > inp_elements;
-                vector < float > inp_mass_percents;
+            return err;
+        };
 
-                for (int i = 0; i < samples[sample_ID].get_num_elements(); i++)
-                {
-                    cout << "Please enter the symbol for element #" << i+1 << ": ";
-                    getline(cin, user_input);
+        if (!verify)
+        {
+            return (run_batch(source, destination, num_threads, stealing, NULL, true) == NO_ERR) ? EXIT_OK : EXIT_DATA;
+        }
 
-                    inp_elements.push_back(user_input);
+        //Run serially keeping only checksums of the output, then in parallel writing
+        //it, and compare the two chunk by chunk. The input is read twice, so standard
+        //input is held in memory; files are read again.
+        stringstream text;
+        if (batch_file == "-") text << source.rdbuf();
 
-                    cout << "Please enter the mass percentage for element #" << i+1 << " (fraction between 0-1): ";
-                    getline(cin, user_input);
+        ifstream second;
+        if (batch_file != "-") second.open(batch_file.c_str());
 
-                    inp_mass_percents.push_back(atof(user_input.c_str()));
-                }
+        istream & serial_in = (batch_file == "-") ? (istream &) text : (istream &) input;
+        istream & parallel_in = (batch_file == "-") ? (istream &) text : (istream &) second;
 
-                err = samples[sample_ID].set_elements(inp_elements);
-                err = samples[sample_ID].set_mass_percents(inp_mass_percents);
+        ChecksumSink * serial = NULL;
+        ChecksumSink * parallel = NULL;
+        ostream discard(NULL);
 
-                cout << endl << "Sample has been successfully set up." << endl;
-            }
+        int err = run_batch(serial_in, discard, 1, false, &serial, false);
 
+        text.clear();
+        text.seekg(0);
 
-        }
-        //Write sample info to screen
-        else if (filtered_input[1] == "write")
-        {
-            //Show samples
-            int sample_ID = parse_input("list");
+        run_batch(parallel_in, destination, num_threads, stealing, &parallel, true);
 
-            if (sample_ID != NO_SAMPLES)
-            {
-                err = samples[sample_ID].write_screen();
+        size_t diff;
+        bool same = serial->matches(*parallel, &diff);
+        size_t num_bytes = serial->num_bytes;
 
-                string filename_temp = samples[sample_ID].get_name();
-                err = samples[sample_ID].write_file(filename_temp);
+        delete serial;
+        delete parallel;
 
-                cout << "Sample has been saved to " << samples[sample_ID].get_name() << ".txt." << endl;
-            }
-        }
-        else
+        if (!same)
         {
-            cout << "Bad subcommand under command 'sample' -- Please re-input." << endl;
-            err = BAD_INPUT;
-        }
-    }
-    //List samples
-    else if (filtered_input[0] == "list")
-    {
-        //Make sure 'samples' isn't empty
-        if (samples.size() != 0)
-        {
-            cout << "List of samples:" << endl;
+            cerr << "Serial and " << num_threads << "-thread output differ from byte " << diff << endl;
 
-            //List samples
-            for (unsigned int i = 0; i < samples.size(); i++)
+            //Output that failed the comparison is not kept
+            if (output_file.size())
             {
-                cout << i << ". " << samples[i].get_name() << endl;
+                file.close();
+                remove(output_file.c_str());
             }
 
-            //Get ID if requested
-            if (filtered_input[1] == "ID")
-            {
-                int sample_ID = NO_SAMPLES;
+            return EXIT_MISMATCH;
+        }
 
-                //Get the sample ID
-                do
-                {
-                    cout << "Enter the ID of the sample you wish to select: ";
-                    getline(cin, user_input);
+        cerr << "Serial and " << num_threads << "-thread output identical (" << num_bytes << " bytes)" << endl;
+
+        return (err == NO_ERR) ? EXIT_OK : EXIT_DATA;
+    }
 
-                    if (isdigit(*user_input.c_str()))
-                    {
-                        sample_ID = atoi(user_input.c_str());
-                    }
+    vector < string > elements;
+    vector < float > mass_percents;
 
-                }while(!(sample_ID >= 0 && sample_ID < samples.size()));
+    if (formula.size() == 0 || density <= 0 || energy <= 0 || dilution < 0 || dilution >= 1)
+    {
+        cerr << "Usage: " << argv[0] << " --formula Fe2O3 --density 5.24 --energy 7.112" << endl;
+        cerr << "       [--dilute 0.3] [--radius 0.65] [--lengths 1 | --step 1]" << endl;
+        cerr << "       [--backend mcmaster|interpolated|file] [--fast-math] [--json]" << endl;
+        cerr << "   or: " << argv[0] << " --batch file|- [--output file] [--format csv|text|binary]" << endl;
+        cerr << "       [--threads n] [--static] [--window jobs] [--shard i/N] [--verify]" << endl;
+        cerr << "       [--cache directory] [--trace file.json]" << endl;
+        cerr << "       (--verify ignores --cache and holds standard input, but not files, in memory)" << endl;
+        cerr << "   or: " << argv[0] << " --merge output shard_0 ... shard_N-1" << endl;
+        cerr << "   or: " << argv[0] << " --bench [--threads n]" << endl;
+        cerr << "   or: " << argv[0] << " --validate [--max-error 1e-6] [--threads n]" << endl;
+        return EXIT_USAGE;
+    }
 
-                return sample_ID;
-            }
-        }
-        else
+    int err = parse_formula(formula, &elements, &mass_percents);
+
+    //A symbol that is no element is a bad argument; a real element without data is not
+    if (err == NO_DATA)
+    {
+        cerr << "No atomic weight is available for an element of " << formula << endl;
+        return EXIT_DATA;
+    }
+    else if (err != NO_ERR)
+    {
+        cerr << "Could not parse formula " << formula << " (unknown element or bad syntax)" << endl;
+        return EXIT_USAGE;
+    }
+
+    //Every element needs cross sections at the requested energy
+    for (int i = 0; i < elements.size(); i++)
+    {
+        double retEnergy[9];
+        double xsec[11];
+        double fl_yield[4];
+        char err_msg[100];
+
+        err = backend->evaluate(elements[i], energy, 0, retEnergy, xsec, fl_yield, err_msg);
+
+        if (err != no_error && err != within_edge && err != m_edge_warn)
         {
-            cout << "No samples have been created yet." << endl;
-            err = NO_SAMPLES;
+            cerr << err_msg << endl;
+            return EXIT_DATA;
         }
     }
-    //Bad command name
+
+    Sample sample(formula);
+    sample.set_num_elements(elements.size());
+    sample.set_elements(move(elements));
+    sample.set_mass_percents(move(mass_percents));
+    sample.set_density(density);
+    sample.set_energy(energy);
+    sample.set_geometry(geometry);
+
+    if (dilution > 0) sample.compute_dilution(dilution);
+
+    if (sample.compute() != NO_ERR)
+    {
+        cerr << "No absorption edge near " << energy << " keV to size " << formula << " by its edge step" << endl;
+        return EXIT_DATA;
+    }
+
+    if (json)
+    {
+        sample.write_json(cout);
+    }
     else
     {
-        cout << "Bad command name. Please re-input." << endl;
+        sample.write_screen();
     }
 
-    cout << endl;
-    return err;
+    return EXIT_OK;
 }
 
-int main()
+int main(int argc, char * argv[])
 {
-    int err = NO_ERR;
+    //One-shot mode
+    if (argc > 1)
+    {
+        int status = run_command_line(argc, argv);
+        tracer.stop();
+
+        return status;
+    }
 
     //Welcome message
     cout << "Welcome to the XAFS Sample Prep Calculator" << endl;
     cout << "Type 'help' for help and 'quit' to quit the program" << endl;
     cout << "Created by Eddie Kim, July 2012" << endl << endl;
 
+    int err = start_console();
+
     //Input loop
     do
     {
-        err = parse_input("none");
+        err = parse_input();
 
     }while(err != EXIT_CMD);
 
+    tracer.stop();
+
     return 0;
 }
@@ -1426,8 +1426,81 @@ static double n_fit[ZMAX][4] = {
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include "mucal.h"
 
+/* 256-byte records aligned to 128 bytes keep the edge and scattering
+ * lines of each element in one adjacent-line prefetch pair */
+static mu_element records[ZMAX]
+#if defined(__GNUC__)
+__attribute__((aligned(128)))
+#endif
+;
+static pthread_once_t records_once = PTHREAD_ONCE_INIT;
+
+/*---------------------------------------------------------------
+ * build_records
+ *    gather the cross-section tables above into one aligned
+ *    record per element
+ *---------------------------------------------------------------*/
+
+static void build_records(void)
+{
+  int Z, i;
+  mu_element *r;
+
+  for (Z=0; Z<ZMAX; Z++) {
+    r = &records[Z];
+    r->edge[0] = k_edge[Z];
+    r->edge[1] = l1_edge[Z];
+    r->edge[2] = l2_edge[Z];
+    r->edge[3] = l3_edge[Z];
+    r->edge[4] = m_edge[Z];
+    r->conv_fac = conv_fac[Z];
+    r->density = density[Z];
+    r->l3_jump = l3_jump[Z];
+    for (i=0; i<4; i++) {
+      r->coh_fit[i] = xsect_coh[Z][i];
+      r->ncoh_fit[i] = xsect_ncoh[Z][i];
+      r->photo_fit[0][i] = k_fit[Z][i];
+      r->photo_fit[1][i] = l_fit[Z][i];
+      r->photo_fit[2][i] = m_fit[Z][i];
+      r->photo_fit[3][i] = n_fit[Z][i];
+    }
+  }
+}
+
+/*---------------------------------------------------------------
+ * mucal_element
+ *    return the packed record for an element, or NULL if
+ *    Z is out of range
+ *---------------------------------------------------------------*/
+
+const mu_element *mucal_element(int Z)
+{
+  if (Z<1 || Z>ZMAX) return NULL;
+  pthread_once(&records_once, build_records);
+  return &records[Z-1];
+}
+
+/*---------------------------------------------------------------
+ * mucal_columns
+ *    return a structure-of-arrays view of the element tables
+ *    for loops that sweep one quantity over many elements
+ *---------------------------------------------------------------*/
+
+const mu_columns *mucal_columns(void)
+{
+  static const mu_columns columns = {
+    ZMAX,
+    k_edge, l1_edge, l2_edge, l3_edge, m_edge,
+    conv_fac, at_weight, density, l3_jump,
+    xsect_coh, xsect_ncoh,
+    k_fit, l_fit, m_fit, n_fit
+  };
+  return &columns;
+}
+
 /*---------------------------------------------------------------
  * name_z
  *    given an element name, return its atomic number
@@ -1476,6 +1549,233 @@ double mcmaster(double ephot, double *fit)
   return xsec;
 }
 
+/*---------------------------------------------------------------
+ * fast_log, fast_exp
+ *    polynomial approximations for mcmaster_fast. the argument
+ *    is reduced by a power of two with frexp/ldexp, then
+ *      log: 2*atanh series in t=(m-1)/(m+1), |t|<0.172, to t^9
+ *      exp: taylor series on |r|<=ln2/2, to r^8
+ *    the truncation error is below 1e-9 for both, so the fast
+ *    cross sections follow the libm path to a few 1e-9 (see
+ *    the --validate option of xafsprep).
+ *    x must be positive and finite for fast_log.
+ *---------------------------------------------------------------*/
+
+static const double ln2 = 0.69314718055994530942;
+
+MUCAL_INLINE double fast_log(double x)
+{
+  int e;
+  double m = frexp(x, &e), t, t2;
+
+  /* move the mantissa to [sqrt(1/2), sqrt(2)) */
+  if (m < 0.70710678118654752440) {
+    m *= 2.0;
+    e--;
+  }
+
+  t = (m - 1.0) / (m + 1.0);
+  t2 = t * t;
+
+  return e * ln2 + 2.0 * t * (1.0 + t2 * (1.0/3 + t2 * (1.0/5 + t2 * (1.0/7 + t2 * (1.0/9)))));
+}
+
+MUCAL_INLINE double fast_exp(double x)
+{
+  double k = floor(x / ln2 + 0.5), r = x - k * ln2;
+
+  return ldexp(1.0 + r * (1.0 + r * (1.0/2 + r * (1.0/6 + r * (1.0/24 + r * (1.0/120
+	       + r * (1.0/720 + r * (1.0/5040 + r * (1.0/40320)))))))), (int) k);
+}
+
+/*---------------------------------------------------------------
+ * mcmaster_fast
+ *    mcmaster with the polynomial in log(E) evaluated by horner
+ *    and the approximate log/exp above
+ *---------------------------------------------------------------*/
+
+MUCAL_INLINE double mcmaster_fast(double ephot, const double *fit)
+{
+  double log_e = fast_log(ephot);
+
+  return fast_exp(fit[0] + log_e * (fit[1] + log_e * (fit[2] + log_e * fit[3])));
+}
+
+/*---------------------------------------------------------------
+ * mucal_fast_math
+ *    select the fast approximations for mucal and mu_z (on=1)
+ *    or the libm reference path (on=0, the default). returns
+ *    the previous setting. not meant to be changed while other
+ *    threads are evaluating.
+ *---------------------------------------------------------------*/
+
+static int fast_math = 0;
+
+int mucal_fast_math(int on)
+{
+  int previous = fast_math;
+
+  if (on >= 0) fast_math = on;
+  return previous;
+}
+
+
+/*---------------------------------------------------------------
+ * mucal_core
+ *    calculate the quantities selected by 'want' for an element
+ *    record, without any input checking or messages. ephot=0
+ *    returns constants only, as in mucal. the return code is
+ *    the warning mucal would give (no_error, within_edge or
+ *    m_edge_warn). when called with constant 'unit' and 'want'
+ *    the compiler drops the work that is not asked for. adding
+ *    want_fast to 'want' evaluates the fits with mcmaster_fast.
+ *---------------------------------------------------------------*/
+
+MUCAL_INLINE int mucal_core(const mu_element *r, double ephot, int unit, int want,
+			    double *energy, double *xsec, double *fluo)
+{
+  int i, shell, Z, err = no_error;
+  double barn_photo, barn_coh, barn_ncoh, barn_tot;
+
+  Z = r - records;         /* C numbers arrays elements from 0 */
+
+  /* stuff the energy-independent parts of all arrays */
+  if (want & want_edges) {
+    for (i=0; i<5; i++) energy[i] = r->edge[i];
+    energy[5] = k_alpha1[Z];
+    energy[6] = k_beta1[Z];
+    energy[7] = l_alpha1[Z];
+    energy[8] = l_beta1[Z];
+  }
+
+  if (want & (want_total | want_components)) {
+    xsec[3] = 0.0;    /* total */
+  }
+  if (want & want_components) {
+    xsec[0] = 0.0;    /* photo */
+    xsec[1] = 0.0;    /* coherent */
+    xsec[2] = 0.0;    /* incoherent */
+    xsec[4] = 0.0;    /* conversion factor */
+    xsec[5] = 0.0;    /* absorption  coef */
+  }
+  if (want & want_constants) {
+    xsec[6] = at_weight[Z];
+    xsec[7] = r->density;
+    if (Z+1 > 27) {
+      xsec[8] = l1_jump;
+      xsec[9] = l2_jump;
+    } else {
+      xsec[8] = 0.0;
+      xsec[9] = 0.0;
+    }
+    xsec[10] = r->l3_jump;
+  }
+
+  if (want & want_yields) {
+    fluo[0] = k_yield[Z];
+    fluo[1] = l_yield[Z][0];
+    fluo[2] = l_yield[Z][1];
+    fluo[3] = l_yield[Z][2];
+  }
+
+  /* is ephot=0 return physical constants and x-ray energies only */
+  if (ephot == 0.0 || !(want & (want_total | want_components))) return err;
+
+  /* check for middle of edge input */
+  if ( (fabs(r->edge[0] - ephot) <= 0.001) ||    /* data within K edge */
+       (fabs(r->edge[1] - ephot) <= 0.001) ||   /* data within L1 edge */
+       (fabs(r->edge[2] - ephot) <= 0.001) ||   /* data within L2 edge */
+       (fabs(r->edge[3] - ephot) <= 0.001) ||   /* data within L3 edge */
+       (fabs(r->edge[4] - ephot) <= 0.001) )    /* data within M edge */
+    err=within_edge;     /* non-terminal error */
+
+  /* determine shell being ionized */
+  if (ephot >= r->edge[0])               /* K shell */
+    shell = 1;
+  else if (ephot >= r->edge[3])          /* L shell */
+    shell = 2;
+  else if (ephot >= r->edge[4])          /* M1 subshell */
+    shell = 3;
+  else                                   /* everything else */
+    shell = 4;
+
+  /* calculate photo-absorption barns/atom x-section */
+  if (want & want_fast)
+    barn_photo = mcmaster_fast(ephot, r->photo_fit[shell-1]);
+  else
+    barn_photo = mcmaster(ephot, (double *) r->photo_fit[shell-1]);
+
+  /* L-shell fits need step corrections below L1 */
+  if (shell == 2 && ephot < r->edge[1]) {
+    if (ephot >= r->edge[2])          /* between L1 and L2 */
+      barn_photo /= l1_jump;
+    else                              /* between L2 and L3 */
+      barn_photo /= (l1_jump * l2_jump);
+  }
+
+  /* M edges for Z<30 are unreliable */
+  if (shell > 2 && Z+1 < 30) err = m_edge_warn;
+
+  /* calculate coherent, incoherent x-sections, and total */
+  if (want & want_fast) {
+    barn_coh = mcmaster_fast(ephot, r->coh_fit);
+    barn_ncoh = mcmaster_fast(ephot, r->ncoh_fit);
+  } else {
+    barn_coh = mcmaster(ephot, (double *) r->coh_fit);
+    barn_ncoh = mcmaster(ephot, (double *) r->ncoh_fit);
+  }
+  barn_tot = barn_photo + barn_coh + barn_ncoh;
+
+  /* stuff the x-section array with the barn/atom data */
+  xsec[3] = barn_tot;
+  if (want & want_components) {
+    xsec[0] = barn_photo;
+    xsec[1] = barn_coh;
+    xsec[2] = barn_ncoh;
+    xsec[4] = r->conv_fac;                          /* conversion factor */
+    xsec[5] = barn_tot * r->density / r->conv_fac;  /* absorption  coef */
+  }
+
+  /* convert to cm^2/g if necessary */
+  if (unit == unit_cm2g) {
+    xsec[3] /= r->conv_fac;
+    if (want & want_components)
+      for (i=0; i<3; i++) xsec[i] /= r->conv_fac;
+  }
+
+  return err;
+}
+
+
+/*---------------------------------------------------------------
+ * mu_z
+ *    total mass attenuation (cm^2/g) of an element at a photon
+ *    energy. there is no checking at all: Z must have data
+ *    (see mucal_has_data) and ephot must be positive.
+ *---------------------------------------------------------------*/
+
+double mu_z(int Z, double ephot)
+{
+  double xsec[4];
+
+  if (fast_math)
+    mucal_core(mucal_element(Z), ephot, unit_cm2g, want_total | want_fast, NULL, xsec, NULL);
+  else
+    mucal_core(mucal_element(Z), ephot, unit_cm2g, want_total, NULL, xsec, NULL);
+  return xsec[3];
+}
+
+/*---------------------------------------------------------------
+ * mucal_has_data
+ *    non-zero if McMaster fits are available for Z
+ *---------------------------------------------------------------*/
+
+int mucal_has_data(int Z)
+{
+  const mu_element *r = mucal_element(Z);
+
+  return r != NULL && r->conv_fac > 0.0;
+}
 
 /*---------------------------------------------------------------
  * mucal
@@ -1489,11 +1789,11 @@ double mcmaster(double ephot, double *fit)
 int mucal(char *name, int ZZ, double ephot, char unit, int pflag,
 	  double *energy, double *xsec, double *fluo, char *errmsg)
 {
-  int i, shell, namef, Z, err;
-  double barn_photo, barn_coh, barn_ncoh, barn_tot;
+  int namef, Z, err;
+  const mu_element *r;
 
   *errmsg = 0;       /* no errors yet */
-  err = (namef = (Z = (shell = 0)));
+  err = (namef = (Z = 0));
 
   /* either name or Z must be given */
   if (!(namef = strlen(name)) && ZZ==0) {
@@ -1522,7 +1822,7 @@ int mucal(char *name, int ZZ, double ephot, char unit, int pflag,
   }
 
   /* make sure material is available */
-  if (Z==85 || Z==85 || Z==87 || Z==88 || Z==89 || Z==91 || Z==93) {
+  if (Z==84 || Z==85 || Z==87 || Z==88 || Z==89 || Z==91 || Z==93) {
     strcpy(errmsg,
        "mucal: no data is avaialble for Po, At, Fr, Ra, Ac, Pa, Np");
     if (pflag) fprintf(stderr, "\n%s\a\n\n", errmsg);
@@ -1544,6 +1844,7 @@ int mucal(char *name, int ZZ, double ephot, char unit, int pflag,
   }
 
   /* OK, input is fine */
+  r = mucal_element(Z);
   Z--;         /* C numbers arrays elements from 0 */
   if (!namef) name = element[Z];
 
@@ -1554,121 +1855,29 @@ int mucal(char *name, int ZZ, double ephot, char unit, int pflag,
     return bad_energy;         /* this is a terminal error */
   }
 
-  /* stuff the energy-independent parts of all arrays */
-  energy[0] = k_edge[Z];
-  energy[1] = l1_edge[Z];
-  energy[2] = l2_edge[Z];
-  energy[3] = l3_edge[Z];
-  energy[4] = m_edge[Z];
-  energy[5] = k_alpha1[Z];
-  energy[6] = k_beta1[Z];
-  energy[7] = l_alpha1[Z];
-  energy[8] = l_beta1[Z];
-
-  xsec[0] = 0.0;    /* photo */
-  xsec[1] = 0.0;    /* coherent */
-  xsec[2] = 0.0;    /* incoherent */
-  xsec[3] = 0.0;    /* total */
-  xsec[4] = 0.0;    /* conversion factor */
-  xsec[5] = 0.0;    /* absorption  coef */
-  xsec[6] = at_weight[Z];
-  xsec[7] = density[Z];
-  if (Z+1 > 27) {
-    xsec[8] = l1_jump;
-    xsec[9] = l2_jump;
-  } else {
-    xsec[8] = 0.0;
-    xsec[9] = 0.0;
-  }
-  xsec[10] = l3_jump[Z];
-
-  fluo[0] = k_yield[Z];
-  fluo[1] = l_yield[Z][0];
-  fluo[2] = l_yield[Z][1];
-  fluo[3] = l_yield[Z][2];
+  /* calculate everything */
+  err = mucal_core(r, ephot, (toupper(unit) == 'C') ? unit_cm2g : unit_barns,
+                   fast_math ? want_all | want_fast : want_all, energy, xsec, fluo);
 
-  /* is ephot=0 return physical constants and x-ray energies only */
   if (ephot == 0.0) return err;
 
-  /* check for middle of edge input */
-  if ( (fabs(k_edge[Z] - ephot)  <= 0.001) ||    /* data within K edge */
-       (fabs(l1_edge[Z] - ephot) <= 0.001) ||   /* data within L1 edge */
-       (fabs(l2_edge[Z] - ephot) <= 0.001) ||   /* data within L2 edge */
-       (fabs(l3_edge[Z] - ephot) <= 0.001) ||   /* data within L3 edge */
-       (fabs(m_edge[Z] - ephot) <= 0.001) ) {  /* data within M edge */
+  /* report warnings; the M-edge warning takes precedence */
+  if ( (fabs(r->edge[0] - ephot) <= 0.001) ||    /* data within K edge */
+       (fabs(r->edge[1] - ephot) <= 0.001) ||   /* data within L1 edge */
+       (fabs(r->edge[2] - ephot) <= 0.001) ||   /* data within L2 edge */
+       (fabs(r->edge[3] - ephot) <= 0.001) ||   /* data within L3 edge */
+       (fabs(r->edge[4] - ephot) <= 0.001) ) {  /* data within M edge */
     sprintf(errmsg, "%s\n%s",
       "mucal:  photon energy  is within 1 eV of edge",
       "        fit results may be inaccurate");
     if (pflag) fprintf(stderr, "\n%s\a\n\n", errmsg);
-    err=within_edge;     /* non-terminal error */
-  }
-
-  /* determine shell being ionized */
-  if (ephot >= k_edge[Z])                /* K shell */
-    shell = 1;
-  else if (ephot >= l3_edge[Z])          /* L shell */
-    shell = 2;
-  else if (ephot >= m_edge[Z])           /* M1 subshell */
-    shell = 3;
-  else                                   /* everything else */
-    shell = 4;
-
-  /* calculate photo-absorption barns/atom x-section */
-  switch (shell) {
-
-    case 1:        /* K shell */
-      barn_photo = mcmaster(ephot, k_fit[Z]);
-      break;
-
-    case 2:        /* L shell */
-      barn_photo = mcmaster(ephot, l_fit[Z]);
-      if (ephot >= l1_edge[Z])   /* above L1-no corrections */
-         break;
-      else if (ephot >= l2_edge[Z]) /* between L1 and L2 */
-	barn_photo /= l1_jump;
-      else if (ephot >= l3_edge[Z])   /* between L2 and L3 */
-	barn_photo /= (l1_jump * l2_jump);
-      break;
-
-    case 3:        /* M1 subshell */
-      barn_photo = mcmaster(ephot, m_fit[Z]);
-      break;
-
-    case 4:        /* all other shells  */
-      barn_photo = mcmaster(ephot, n_fit[Z]);
-      break;
-
-    default:       /* this should never happen */
-      strcpy(errmsg, "mucal: congratualtions, you have just found a bug");
-      if (pflag) fprintf(stderr, "\n%s\a\n\n", errmsg);
-      return satan_rules;
   }
 
-  /* M edges for Z<30 are unreliable */
-  if (shell > 2 && Z+1 < 30) {
+  if (err == m_edge_warn) {
     sprintf(errmsg, "%s\n%s",
       "mucal: McMaster et al. use L-edge fits for the M edges for Z<30",
       "WARNING: results may be inaccurate");
     if (pflag) fprintf(stderr, "\n%s\a\n\n", errmsg);
-    err = m_edge_warn;
-  }
-
-  /* calculate coherent, incoherent x-sections, and total */
-  barn_coh = mcmaster(ephot, xsect_coh[Z]);
-  barn_ncoh = mcmaster(ephot, xsect_ncoh[Z]);
-  barn_tot = barn_photo + barn_coh + barn_ncoh;
-
-  /* stuff the x-section array with the barn/atom data */
-  xsec[0] = barn_photo;
-  xsec[1] = barn_coh;
-  xsec[2] = barn_ncoh;
-  xsec[3] = barn_tot;
-  xsec[4] = conv_fac[Z];                          /* conversion factor */
-  xsec[5] = barn_tot * density[Z] / conv_fac[Z];  /* absorption  coef */
-
-  /* convert to cm^2/g if necessary */
-  if (toupper(unit) == 'C') {
-    for (i=0; i<4; i++) xsec[i] /= xsec[4];
   }
 
   /* we are done */
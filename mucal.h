@@ -20,7 +20,66 @@ enum {
   satan_rules=666      /* internal error of dubious origin :-) */
 };
 
+/* per-element cross-section record, packed in the order mucal() reads it.
+ * an energy evaluation touches the edge line, the scattering fit line
+ * and the line holding the photo-absorption fit for the shell; its 18
+ * doubles do not fit in two lines, so three is the least it can touch.
+ * x-ray lines, atomic weights and yields are not needed for cross
+ * sections and are read from the tables in mucal.c instead. */
+typedef struct {
+  /* line 0: shell selection and unit conversion */
+  double edge[5];          /* k, l1, l2, l3, m edges (keV) */
+  double conv_fac;         /* cm^2/g to barns/atom, 0 if there is no data */
+  double density;          /* g/cm^3 */
+  double l3_jump;
+  /* line 1: coherent and incoherent scattering fits */
+  double coh_fit[4];
+  double ncoh_fit[4];
+  /* lines 2-3: photo-absorption fits for k, l, m and outer shells */
+  double photo_fit[4][4];
+}
+#if defined(__GNUC__)
+__attribute__((aligned(64)))
+#endif
+mu_element;
+
+/* structure-of-arrays view of the same data, indexed by Z-1 */
+typedef struct {
+  int zmax;
+  const double *k_edge, *l1_edge, *l2_edge, *l3_edge, *m_edge;
+  const double *conv_fac, *at_weight, *density, *l3_jump;
+  const double (*coh_fit)[4], (*ncoh_fit)[4];
+  const double (*k_fit)[4], (*l_fit)[4], (*m_fit)[4], (*n_fit)[4];
+} mu_columns;
+
+/* units and quantities for mucal_core */
+enum {
+  unit_cm2g = 0,         /* cross sections in cm^2/g */
+  unit_barns = 1         /* cross sections in barns/atom */
+};
+
+enum {
+  want_total = 1,        /* xsec[3] */
+  want_components = 2,   /* xsec[0-5] */
+  want_edges = 4,        /* energy[0-8] */
+  want_constants = 8,    /* xsec[6-10] */
+  want_yields = 16,      /* fluo[0-3] */
+  want_all = 31,
+  want_fast = 32         /* polynomial log/exp instead of libm */
+};
+
+#if defined(__GNUC__)
+#define MUCAL_INLINE static inline __attribute__((always_inline))
+#else
+#define MUCAL_INLINE static inline
+#endif
+
 int name_z(char *name);
+const mu_element *mucal_element(int Z);
+const mu_columns *mucal_columns(void);
+int mucal_has_data(int Z);
+double mu_z(int Z, double ephot);
+int mucal_fast_math(int on);
 int mucal(char *name, int ZZ, double ephot, char unit, int pflag,
 	  double *energy, double *xsec, double *fluo, char *errmsg);
 